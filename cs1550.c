@@ -13,20 +13,39 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
 
 // Index at which to start allocating new directories
-// and files in the bitmap
+// and files in the bitmap of an image without a superblock
 #define START_ALLOC_INDEX 2
 
-//size of a disk block
-#define	BLOCK_SIZE 512
+//smallest and largest block an image can have. An image without a
+//superblock always has the smallest.
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (64 * 1024)
+
+//size of a disk block. It comes from the superblock at mount, so this
+//and everything sized by it is only known at run time. (linux/fs.h,
+//through io_uring.h, has a BLOCK_SIZE of its own.)
+#undef BLOCK_SIZE
+#define	BLOCK_SIZE (geometry.nBlockSize)
 
 //we'll use 8.3 filenames
 #define	MAX_FILENAME 8
 #define	MAX_EXTENSION 3
 
 //How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+#define MAX_FILES_IN_DIR (geometry.nFilesInDir)
 
 //The attribute packed means to not align these things
 struct cs1550_directory_entry
@@ -40,16 +59,14 @@ struct cs1550_directory_entry
 		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
 		size_t fsize;					//file size
 		long nStartBlock;				//where the first block is on disk
-	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
+	} __attribute__((packed)) files[];	//There are MAX_FILES_IN_DIR of these
 
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+	//The rest of the block is padding. Don't use it for anything.
 } ;
 
 typedef struct cs1550_root_directory cs1550_root_directory;
 
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+#define MAX_DIRS_IN_ROOT (geometry.nDirsInRoot)
 
 struct cs1550_root_directory
 {
@@ -59,17 +76,15 @@ struct cs1550_root_directory
 	{
 		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
 		long nStartBlock;				//where the directory block is on disk
-	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
+	} __attribute__((packed)) directories[];	//There are MAX_DIRS_IN_ROOT of these
 
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+	//The rest of the block is padding. Don't use it for anything.
 } ;
 
 
 typedef struct cs1550_directory_entry cs1550_directory_entry;
 
-#define MAX_MAP_ENTRIES (BLOCK_SIZE/sizeof(short))
+#define MAX_MAP_ENTRIES (MIN_BLOCK_SIZE/sizeof(short))
 
 
 // Struct to store blocks from the fille allocation table
@@ -79,1072 +94,4330 @@ struct cs1550_bitmap_block {
 
 typedef struct cs1550_bitmap_block cs1550_bitmap;
 
-//How much data can one block hold?
-#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE)
+//Marks block 0 as a superblock. An image without it is the original
+//layout: the root at block 0 and a single block of short entries at block 1.
+//The first field of that root is nDirectories, which can never be this big.
+#define CS1550_MAGIC 0x30353531
+
+//Version of the layout described by the superblock
+#define CS1550_VERSION 1
 
-struct cs1550_disk_block
+//Block 0 of an image that has an allocation table with one 32-bit entry
+//for every block on the disk. The table spans as many blocks as it needs,
+//so its size is set by how big .disk is when it gets formatted.
+struct cs1550_superblock
 {
-	//All of the space in the block can be used for actual data
-	//storage.
-	char data[MAX_DATA_IN_BLOCK];
+	int magic;			//CS1550_MAGIC
+	int version;		//CS1550_VERSION
+	int nBlockSize;		//size of a block in bytes
+	int nEntrySize;		//size of an allocation table entry in bytes
+	long nBlocks;		//how many blocks the table covers
+	long nRootBlock;	//where the root directory is on disk
+	long nTableStart;	//first block of the allocation table
+	long nTableBlocks;	//how many blocks the table takes up
+	long nDataStart;	//first block that can be handed out
+	int nFeatures;		//CS1550_FEATURE_* flags, carved out of what used to be padding
+	int nFilesInDir;	//how many files a directory block holds, 0 for as many as fit
+	int nDirsInRoot;	//how many directories the root holds, 0 for as many as fit
+
+	//The rest of the block is padding. Don't use it for anything.
 };
 
-typedef struct cs1550_disk_block cs1550_disk_block;
-
-// Function to open up .disk and read in the
-// bitmap from it
-static cs1550_bitmap get_bitmap() {
-	// Open the .disk file
-	FILE* disk = fopen(".disk", "r+b");
-	// Seek to position block_size in disk
-	fseek(disk, BLOCK_SIZE, SEEK_SET);
-	// Initialize bitmap block and read it in
-	cs1550_bitmap bitmap;
-	fread(&bitmap, BLOCK_SIZE, 1, disk);
-	return bitmap;
-}
-
-// Write new bitmap data to .disk
-static void write_new_bitmap(cs1550_bitmap* bitmap) {
-	// Open disk
-	FILE* disk = fopen(".disk", "r+b");
-	// Seek to position BLOCK_SIZE
-	fseek(disk, BLOCK_SIZE, SEEK_SET);
-	// Write the bitmap to .disk
-	// and close it
-	fwrite(bitmap, BLOCK_SIZE, 1, disk);
-	fclose(disk);
-}
-
-// Get root from the .disk file
-static cs1550_root_directory get_root_dir() {
-	// Open up the .disk file
-	FILE* disk_file = fopen(".disk", "r+b");
-	// Set the file position at 0
-	fseek(disk_file, 0, SEEK_SET);
-	// Create a root_directory and read the .disk
-	// file into it
-	cs1550_root_directory root_dir;
-	fread(&root_dir, BLOCK_SIZE, 1, disk_file);
-	// Return the root_directory
-	return root_dir;
-}
-
-//Write the root data from a given pointer to disk at block 0
-// Write new root directory information to .disk
-// a position BLOCK_SIZE
-static void write_new_root(cs1550_root_directory* root_on_disk) {
-	// Open disk
-	FILE* disk = fopen(".disk", "r+b");
-	// Write root to disk
-	fwrite(root_on_disk, BLOCK_SIZE, 1, disk);
-	fclose(disk);
-}
-
-
-/*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not. 
- *
- * man -s 2 stat will show the fields of a stat structure
- */
-static int cs1550_getattr(const char *path, struct stat *stbuf)
+typedef struct cs1550_superblock cs1550_superblock;
+
+//Table entries and the block numbers in them are ints, so the table
+//covers no more blocks than that. Any past it on a bigger image go unused.
+#define MAX_TABLE_ENTRIES ((long) INT_MAX)
+
+//Files on the image keep a list of extents instead of a chain of blocks
+#define CS1550_FEATURE_EXTENTS 0x1
+
+//Directories and the root can grow past one block. The blocks of a
+//directory are chained together through the allocation table the same
+//way the blocks of a file without extents are, and file slot n of the
+//directory is slot n % MAX_FILES_IN_DIR of the chain's
+//n / MAX_FILES_IN_DIR'th block. The root chains on from nRootBlock the
+//same way, MAX_DIRS_IN_ROOT slots to a block. A chain of one block
+//looks the same either way, so an image that doesn't have this yet
+//gets it the first time a directory or the root grows.
+#define CS1550_FEATURE_DIR_CHAINS 0x2
+
+//How many extents fit in one extent block
+#define MAX_EXTENTS_IN_BLOCK ((BLOCK_SIZE - sizeof(int)) / sizeof(struct cs1550_extent))
+
+//On an image with CS1550_FEATURE_EXTENTS, a file's nStartBlock points
+//at one of these instead of at its first data block. The extents are
+//sorted by nFileBlock. If a file needs more extents than fit, the extent
+//blocks are chained together through the allocation table, and the data
+//blocks themselves are marked EOF in the table.
+struct cs1550_extent_block
 {
-	int res = 0;
-		
-	// Variables to store path
-	char dir[MAX_FILENAME + 1];
-	char file_name[MAX_FILENAME + 1];
-	char ext[MAX_EXTENSION + 1];
-
-	//Check if path is root
-	if(strcmp(path, "/") != 0) {
-		// If it is not, then get the current path
-		sscanf(path, "/%[^/]/%[^.].%s", dir, file_name, ext);
-	} else {
-		// If it is set the directory mode to 
-		// directory
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		return res;
-	}
-	
-	// Check if the directory is empty
-	if(strcmp(dir, "") == 0){ 
-		// If the directory is empty then 
-		// the file cannot be found
-		res = -ENOENT;
-		return res;
-	} 
+	int nExtents;	//How many extents are used in this block
 
-	// Clear stat buffer
-	memset(stbuf, 0, sizeof(struct stat));
-
-	// Since we're not in root, we need to find the correct 
-	// directory
-	int i = 0;
-	struct cs1550_directory placeholder;
-	// Initialize  dname
-	strcpy(placeholder.dname, "");
-	placeholder.nStartBlock = -1;
-	// Initialize the root directory
-	cs1550_root_directory root_directory = get_root_dir();
-
-	// Need to iterate through the root's directories 
-	// to find the one we want
-	for(i = 0; i < root_directory.nDirectories; i++) { 
-		// Check if the current directory matches the search directory
-		if(strcmp(root_directory.directories[i].dname, dir) == 0) {
-			// If this matches the one we want then set it as the current directory
-			placeholder = root_directory.directories[i];
-			break;
-		}
-	}
+	struct cs1550_extent
+	{
+		long nFileBlock;	//which block of the file the run starts at
+		long nStartBlock;	//where the run starts on disk
+		long nLength;		//how many blocks are in the run
+	} __attribute__((packed)) extents[];	//There are MAX_EXTENTS_IN_BLOCK of these
 
-	// Check if the directory was found
-	if(strcmp(placeholder.dname, "") == 0) {
-		// It was not so return ENOENT error
-		res = -ENOENT;
-		return res;
-	}
+	//The rest of the block is padding. Don't use it for anything.
+};
 
-	// No where left to go
-	if(strcmp(file_name, "") == 0) {
-		// Return a success and
-		// the appropriate permissions
-		res = 0;
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		return res; 
-	}
+typedef struct cs1550_extent_block cs1550_extent_block;
 
-	// Open .disk and get the file location
-	FILE* disk = fopen(".disk", "r+b");
-	int disk_location = BLOCK_SIZE * placeholder.nStartBlock;
-	// Set file position using the location
-	fseek(disk, disk_location, SEEK_SET);
-	cs1550_directory_entry entry;
-	entry.nFiles = 0;
-	memset(entry.files, 0, MAX_FILES_IN_DIR*sizeof(struct cs1550_file_directory));
+//How much data can one block hold?
+#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE)
 
-	// Read in the directory and all of its data including
-	// any files inside 
-	int items_read = fread(&entry, BLOCK_SIZE, 1, disk);
-	fclose(disk);
-	
-	// Check if a single block was read
-	if(items_read == 1) {
-		// If it was we need to find the file in the directory
-		struct cs1550_file_directory filedir;
-		strcpy(filedir.fext, "");
-		strcpy(filedir.fname, "");
-		filedir.fsize = 0;
-		filedir.nStartBlock = -1;
-				
-		int i = 0;
-		// Need to iterate over the filed in the directory to
-		// find the one we want
-		for(i = 0; i < MAX_FILES_IN_DIR; i++) {
-			// Check if the current file name and extension match
-			// the one we want.
-			if(strcmp(entry.files[i].fname, file_name) == 0 && strcmp(entry.files[i].fext, ext) == 0) { 
-				// It does, so set it to the file struct
-				filedir = entry.files[i];
-				break;
-			}
-		}
+//All of the space in a data block can be used for actual data storage,
+//so a data block is just BLOCK_SIZE bytes.
 
-		// Check if a file was found by checking the starting block
-		if((filedir.nStartBlock) == -1) { 
-			// It was not found so return ENOENT error
-			res = -ENOENT;
-			return res;
-		} else {
-			// File was found, so return success
-			res = 0;
-			stbuf->st_mode = S_IFREG | 0666;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = filedir.fsize;
-			return res;
-		}
-	}
-	return res;
-}
+// How the blocks of the mounted image are laid out. Everything that
+// depends on the block size is worked out from this at mount time.
+struct cs1550_geometry {
+	long nBlockSize;	//bytes in a block
+	long nFilesInDir;	//how many files a directory block holds
+	long nDirsInRoot;	//how many directories the root holds
+};
 
-/* 
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
- */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
-{
-	//Since we're building with -Wall (all warnings reported) we need
-	//to "use" every parameter, so let's just cast them to void to
-	//satisfy the compiler
-	(void) offset;
-	(void) fi;
+//How many files or directories fit in a block of the given size
+#define FILES_IN_BLOCK(size) (((size) - sizeof(int)) / sizeof(struct cs1550_file_directory))
+#define DIRS_IN_BLOCK(size) (((size) - sizeof(int)) / sizeof(struct cs1550_directory))
 
-	//This line assumes we have no subdirectories, need to change
-	if (strcmp(path, "/") != 0) {
-		return -ENOENT;
-	}
+static struct cs1550_geometry geometry = {
+	MIN_BLOCK_SIZE, FILES_IN_BLOCK(MIN_BLOCK_SIZE), DIRS_IN_BLOCK(MIN_BLOCK_SIZE)
+};
 
-	//the filler function allows us to add entries to the listing
-	//read the fuse.h file for a description (in the ../include dir)
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+// The .disk image. It is opened and mapped once at mount time so that
+// every operation works on pointers straight into the image instead of
+// reopening the file and copying blocks around.
+struct cs1550_disk {
+	int fd;			//file descriptor for .disk, -1 until mounted
+	char* map;		//base of the shared mapping of the whole image
+	size_t size;	//size of the image in bytes
+	long nBlocks;	//how many whole blocks the image holds
+};
 
-	// Variable to store the destination
-	char* dest = strtok(path, "/");
+static struct cs1550_disk disk = { -1, NULL, 0, 0 };
 
-	// Check if the current path is root
-	if(strcmp(path, "/") == 0) {
-		int i = 0;
-		
-		cs1550_root_directory root_dir = get_root_dir();
+// Where to find .disk. main fills in the absolute path so that the image
+// can still be found once fuse has daemonized and changed directory.
+static char disk_path[PATH_MAX] = ".disk";
 
-		// Check all directories in root
-		for(i = 0; i < MAX_DIRS_IN_ROOT; i++){ 
-			// Check if the current directory is empty
-			if(strcmp(root_dir.directories[i].dname, "") != 0) {
-				// If it does, print it
-				filler(buf, root_dir.directories[i].dname, NULL, 0);
-			}
-		}
-		return 0;
-	} else {
-		// Varaible to store directory for
-		// checking files
-		struct cs1550_directory directory;
-		strcpy(directory.dname, "");
-		directory.nStartBlock = -1;
+// Mount options, filled in by main
+struct cs1550_options {
+	unsigned long cache_mb;	//memory for the block cache in MiB, 0 turns it off
+	char* io;				//block I/O backend: "uring" (the default) or "pread"
+	unsigned long block_size;	//block size to format a blank image with
+	char* trace;			//file to trace every operation into, NULL for none
+};
 
-		cs1550_root_directory root_dir = get_root_dir();
+static struct cs1550_options options = { 32, NULL, MIN_BLOCK_SIZE, NULL };
+
+// What the kernel is asked for at mount. libfuse 2 cuts max_write down
+// to what its buffer holds, which is 128 KiB. The timeouts, in seconds,
+// are how long the kernel can use a name, a file's attributes or a
+// name that wasn't there without asking us again.
+#define MAX_WRITE (128 * 1024)
+#define CACHE_TIMEOUTS "entry_timeout=60,attr_timeout=60,negative_timeout=1"
+
+// Open the image at path and map all of it into memory
+static int disk_open(const char* path) {
+	// Open the image for reading and writing
+	int fd = open(path, O_RDWR);
+	if(fd < 0) {
+		return -errno;
+	}
 
-		// Check all directories in root 
-		int i = 0;
-		for(i = 0; i < MAX_DIRS_IN_ROOT; i++) {
-			// Check if the current directory is the one we want
-			if(strcmp(dest, root_dir.directories[i].dname) == 0) {
-				// It is, so set dir to the current directory and break
-				directory = root_dir.directories[i];
-				break;
-			}
-		}
+	// Find out how big the image is, it needs at least
+	// room for the root and the bitmap
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < START_ALLOC_INDEX * MIN_BLOCK_SIZE) {
+		close(fd);
+		return -EINVAL;
+	}
 
-		// Check if no directory was found
-		if(strcmp(directory.dname, "") == 0) {
-			// It was not, so send an error back
-			return -ENOENT;
-		} else {
-			// The proper directory has been found
-			// Load disk file to read over directory 
-			FILE* disk = fopen(".disk", "rb+");
-			int disk_location = directory.nStartBlock * BLOCK_SIZE;
-			fseek(disk, disk_location, SEEK_SET);
-
-			cs1550_directory_entry entry;
-			entry.nFiles = 0;
-			memset(entry.files, 0, MAX_FILES_IN_DIR*sizeof(struct cs1550_file_directory));
-
-			// Read in the data from .disk to
-			// entry for use later
-			fread(&entry, BLOCK_SIZE, 1, disk); 
-			fclose(disk);
-
-			i = 0;
-			// Loop over the files in the directory entry and print them out 
-			for(i = 0; i < MAX_FILES_IN_DIR; i++) {
-				// Variable to store the current  
-				struct cs1550_file_directory curr_file_dir = entry.files[i];
-				// Variable to store the file name
-				char full_file_name[MAX_FILENAME+1];
-				strcpy(full_file_name, curr_file_dir.fname);
-				// Check if the file has an extension
-				if(strcmp(curr_file_dir.fext, "") != 0) {
-					// If so, append it
-					strcat(full_file_name, ".");
-					strcat(full_file_name, curr_file_dir.fext);
-				}
-				// Check if the file is empty
-				if(strcmp(curr_file_dir.fname, "") != 0){
-					// If it isn't, print it
-					filler(buf, full_file_name, NULL, 0);
-				}
-			}
-		}
+	// Map the whole thing shared so our stores land in the image
+	char* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		int err = -errno;
+		close(fd);
+		return err;
 	}
+
+	disk.fd = fd;
+	disk.map = map;
+	disk.size = st.st_size;
+	disk.nBlocks = st.st_size / BLOCK_SIZE;
 	return 0;
 }
 
-/* 
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
- */
-static int cs1550_mkdir(const char *path, mode_t mode)
-{
-	(void) path;
-	(void) mode;
-	// Variables to store the directory
-	// and its subdirectory
-	char* dir;
-	char* sub;	
-
-	// Derived from the path
-	dir = strtok(path, "/");
-	sub = strtok(NULL, "/");
+// Switch to a new block size, with as many files and directories in
+// each directory block and the root as fit unless we're told otherwise
+static void disk_set_geometry(long size, long files, long dirs) {
+	geometry.nBlockSize = size;
+	geometry.nFilesInDir = files > 0 ? files : (long) FILES_IN_BLOCK(size);
+	geometry.nDirsInRoot = dirs > 0 ? dirs : (long) DIRS_IN_BLOCK(size);
+	disk.nBlocks = disk.size / size;
+}
 
-	// Check if the directory name is too big
-	if(strlen(dir) > MAX_FILENAME) {
-		// If it is, return an error
-		return -ENAMETOOLONG;
-	} else if(sub) {
-		// The user cannot pass in a subdirectory
-		// If they do, deny permission
-		return -EPERM;
+// Get a pointer to a block inside the mapped image, or NULL if
+// the block is not on the disk
+static void* disk_block(long block) {
+	if(disk.map == NULL || block < 0 || block >= disk.nBlocks) {
+		return NULL;
 	}
+	return disk.map + (block * BLOCK_SIZE);
+}
 
-	// Variables to store the root directory and
-	// the bitmap
-	cs1550_root_directory root_directory = get_root_dir();
-	cs1550_bitmap bitmap = get_bitmap();
+// Push everything we've changed in the mapping out to .disk
+static int disk_sync() {
+	if(disk.map == NULL) {
+		return 0;
+	}
+	if(msync(disk.map, disk.size, MS_SYNC) < 0) {
+		return -errno;
+	}
+	return 0;
+}
 
-	int i = 0;
-	// Go through every directory in the root
-	for(i = 0; i < MAX_DIRS_IN_ROOT; i++) {
-		// Check if the directory the user wants to
-		// create already exists
-		if(strcmp(root_directory.directories[i].dname, dir) == 0) {
-			// If it does, return an error
-			return -EEXIST;
-		}
-	}
-
-	i = 0;
-	// Go through every directory in root
-	for(i = 0; i < MAX_DIRS_IN_ROOT; i++) {
-		// Check if the current directory is nameless
-		if(strcmp(root_directory.directories[i].dname, "") == 0) {
-			// If the directory has no name then we can user it
-			// to store the new directory
-			struct cs1550_directory new_dir;
-			// Add the users directory name to the 
-			// new directory's name
-			strcpy(new_dir.dname, dir);
-			
-			int j = 0;
-			// Go through every member of the bitmap
-			for(j = START_ALLOC_INDEX; j < MAX_MAP_ENTRIES; j++){ //Iterate over the bitmap to find a new block to store the directory in
-				// Check if the current index has anything allocated
-				// to it
-				if(bitmap.table[j] == 0) {
-					// It doesn't so add to it
-					bitmap.table[j] = EOF;
-					// Record index at which file is contained
-					new_dir.nStartBlock = j;
-					break;
-				}
-			}
-			
-			// Open up .disk to write the new directory to it
-			FILE* disk = fopen(".disk", "r+b");
-			int disk_location = BLOCK_SIZE * new_dir.nStartBlock;
-			fseek(disk, disk_location, SEEK_SET);
-			cs1550_directory_entry dir;
-			dir.nFiles = 0;
-			
-			// Read the directory and all of its data
-			int items_read = fread(&dir, BLOCK_SIZE, 1, disk);
-			
-			// Check if a single block was read
-			if(items_read == 1) {
-				memset(&dir, 0, sizeof(struct cs1550_directory_entry));
-				 // Write the new directory to the disk file
-				fwrite(&dir, BLOCK_SIZE, 1, disk);
-				fclose(disk);
-
-				// Update root with an new directory
-				root_directory.nDirectories++;
-				root_directory.directories[i] = new_dir;				
-
-				// Write the new root directory and the new
-				// bitmap to .disk
-				write_new_root(&root_directory);
-				write_new_bitmap(&bitmap);
-			} else {
-				// Error with the disk, close the file 
-				fclose(disk);
-			}
-			return 0;
+// Read len bytes of the image starting at byte pos straight into buf.
+// This goes through the descriptor rather than the mapping so that a
+// long run comes in with one call instead of a page fault per page.
+static int disk_read(char* buf, size_t len, off_t pos) {
+	if(disk.fd < 0 || pos < 0 || pos + len > disk.size) {
+		return -EIO;
+	}
+	while(len > 0) {
+		ssize_t n = pread(disk.fd, buf, len, pos);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		} else if(n < 0) {
+			return -errno;
+		} else if(n == 0) {
+			//the image is shorter than it was at mount
+			return -EIO;
 		}
+		buf += n;
+		len -= n;
+		pos += n;
 	}
 	return 0;
 }
 
-/* 
- * Removes a directory.
- */
-static int cs1550_rmdir(const char *path)
-{
-	(void) path;
-    return 0;
+// Sync and unmap the image at unmount
+static void disk_close() {
+	if(disk.map == NULL) {
+		return;
+	}
+	disk_sync();
+	munmap(disk.map, disk.size);
+	close(disk.fd);
+	disk.map = NULL;
+	disk.fd = -1;
+	disk.size = 0;
+	disk.nBlocks = 0;
 }
 
-/* 
- * Does the actual creation of a file. Mode and dev can be ignored.
- *
- */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
-{
-	(void) mode;
-	(void) dev;
-	
-	//path will be in the format of /directory/sub_directory
-	// Variables to store the directory, file name
-	// and file extension
-	char* dir; //The first directory in the 2-level file system
-	char* file_name; //The directory within the root's directory	
-	char* ext;
-
-	dir = strtok(path, "/");
-	file_name = strtok(NULL, ".");
-	ext = strtok(NULL, ".");
-
-	// Check if directory is not empty
-	if((dir && dir[0]) && strcmp(dir, "") != 0) {
-		// Check if file name is file name is empty
-		if(file_name && file_name[0] && strcmp(file_name, "") == 0) {
-				// If it is, return error
-				return -EPERM;
-		}
-
-		// Check if file extension is null
-		if(ext && ext[0]) {
-			// If neither file extension and the file name are 
-			// null, then check if they are too long
-			if(strlen(file_name) > MAX_FILENAME || strlen(ext) > MAX_EXTENSION) {
-				// If they are return an error
-				return -ENAMETOOLONG;
-			} else {
-				// If file name is not empty but file
-				// extension is empty, then check if
-				// the file name is too long
-				if(strlen(file_name) > MAX_FILENAME) {
-					return -ENAMETOOLONG;
-				} else { 
-					// File name is null or empty, so return
-					// an error
-					return -EPERM;
-				}
-			}
-		}
+// Block I/O backends. The reads and syncs one operation needs from the
+// image are gathered into a batch and handed to the backend together,
+// so the io_uring backend can get all of them to the device with one
+// system call. The pread backend, which is used wherever io_uring isn't
+// available, does them one after another. Writes go into the shared
+// mapping, so all a backend ever writes is a sync of a range of it.
+#define IO_READ 0	//read len bytes of the image from pos into buf
+#define IO_SYNC 1	//make len bytes of the image from pos stable, pos is page aligned
+
+// io_uring only has 32 bits for a length, so a batch carries anything
+// longer than this as several pieces. It's a multiple of any page size.
+#define IO_MAX_LEN (1UL << 30)
+
+struct cs1550_io {
+	int op;			//IO_READ or IO_SYNC
+	char* buf;		//where a read goes
+	size_t len;		//how many bytes
+	off_t pos;		//where in the image
+};
 
-		// Get data for both root directory and bitmap 
-		// and store it
-		cs1550_root_directory root_dir = get_root_dir();
-		cs1550_bitmap bitmap = get_bitmap();
+struct cs1550_io_backend {
+	const char* name;
+	int (*init)();								//0 if the backend can be used
+	void (*fini)();
+	int (*submit)(struct cs1550_io* ios, int n);	//do all n, 0 or the last error
+};
 
-		// Variable store the desired directory
-		struct cs1550_directory directory_to_add_to;
+// Per operation statistics. Every call that comes in through hello_oper
+// is counted and timed here with relaxed atomics, so counting never
+// makes one operation wait on another, and so is the I/O it sends to
+// the backend. They can be read at any time from STATS_PATH, a file
+// that isn't on the image.
+#define STATS_PATH "/.stats"
+#define STATS_BUCKETS 32	//latency buckets, the last one takes everything over 2s
+#define STATS_SIZE 16384	//more than the longest the stats file can get
+
+enum cs1550_op {
+	OP_GETATTR, OP_READDIR, OP_MKDIR, OP_RMDIR, OP_MKNOD, OP_UNLINK, OP_READ,
+	OP_WRITE, OP_TRUNCATE, OP_OPEN, OP_RELEASE, OP_FLUSH, OP_FSYNC, OP_COUNT
+};
 
-		int i = 0;
-		// Go through the directories in root
-		for(i = 0; i < MAX_DIRS_IN_ROOT; i++) {
-			// Check if the directory we are looking for
-			// is the same as teh current directory
-			if(strcmp(dir, root_dir.directories[i].dname) == 0) {
-				// If it is, grab it and store it
-				directory_to_add_to = root_dir.directories[i];
-				break;
-			}
-		}
+// Reads and writes of .disk are charged to the operation that caused
+// them, or to one of these when there isn't one
+#define IO_READAHEAD OP_COUNT			//the readahead thread
+#define IO_BACKGROUND (OP_COUNT + 1)	//mount, unmount and anything else
+#define IO_SOURCES (OP_COUNT + 2)
 
-		// Check if the directory was found
-		if(strcmp(directory_to_add_to.dname, "") != 0) {
-			// bitmap the location of the file to add to
-			// find it in the .disk file
-			long disk_location = BLOCK_SIZE * directory_to_add_to.nStartBlock;
-			// Open .disk file and seek to 
-			// location disk_location
-			FILE* disk = fopen(".disk", "r+b");
-			fseek(disk, disk_location, SEEK_SET);
-			
-			cs1550_directory_entry entry;
-			int items_read = fread(&entry, BLOCK_SIZE, 1, disk);
-
-			// Check if any items were read
-			if(items_read) {
-				int file_exists = 0;
-				int first_free_index = -1;
-
-				int j = 0;
-				// Check over every file in the directory
-				for(j = 0; j < MAX_FILES_IN_DIR; j++) {
-					// Check if the current file is empty, and store that index to use later
-					if(strcmp(entry.files[j].fname, "") == 0 && strcmp(entry.files[j].fext, "") == 0 && first_free_index == -1) {
-						first_free_index = j;
-					}
-
-					// Check if the file with the same name and extension already exists in the directory
-					if(strcmp(entry.files[j].fname, file_name) == 0 && strcmp(entry.files[j].fext, ext) == 0) {
-						// Set out boolean since it does.
-						file_exists = 1;
-						break;
-					}			
-				}
+static const char* op_names[IO_SOURCES] = {
+	"getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink", "read",
+	"write", "truncate", "open", "release", "flush", "fsync",
+	"readahead", "background"
+};
 
-				// Check if the file exists
-				if(!file_exists) {
-					// It does not, so we're good to create it
-					// Varaible to store the start index for the bitmap
-					short bitmap_start_index = -1;
-
-					// Go through and check every member of the bitmap
-					int k = 0;
-					for(k = 2; k < MAX_MAP_ENTRIES; k++) {
-						// If the current index is empty
-						// then store the start index
-						// and mark the index
-						if(bitmap.table[k] == 0) {
-							bitmap_start_index = k;
-							bitmap.table[k] = EOF;
-							break;
-						}
-					}
-
-
-					// Variable to store the new file
-					struct cs1550_file_directory new_file;
-					// Copy over the file name that we want to create
-					strcpy(new_file.fname, file_name);
-					// Check if there is a file extension
-					if(ext && ext[0]) {
-						// If there is a file extension, add it to the file
-						strcpy(new_file.fext, ext);
-					} else {
-						// If there is no file extension, fill
-						// the fext field with an empty string
-						strcpy(new_file.fext, "");
-					}
-					// Initialize new file fields
-					new_file.fsize = 0;
-					new_file.nStartBlock = bitmap_start_index;
-
-					// Use saved index to store teh new file
-					entry.files[first_free_index] = new_file;
-					// Increase number files in the directory
-					entry.nFiles++; 
-
-					// Seek to the index we need to store
-					// the new file at
-					fseek(disk, disk_location, SEEK_SET);
-					// Write the changed directory to .disk
-					fwrite(&entry, BLOCK_SIZE, 1, disk);
-					fclose(disk);
-					
-					//Write the root and bitmap back to disk
-					write_new_root(&root_dir);
-					write_new_bitmap(&bitmap);
-				} else { 
-					// File already exists, so return
-					// a permissions error
-					fclose(disk);
-					return -EEXIST;
-				}
-			} else {
-				// Directory does not have a name so no file can be added
-				fclose(disk);
-				return -EPERM;
-			}
-		} else {
-			// Directory was null or empty, so
-			// just return
-			return 0;
-		}		
-	}
-	return 0;
+// Each operation's counters get their own cache lines so that
+// different operations running at once don't fight over them
+struct cs1550_op_stats {
+	unsigned long calls;
+	unsigned long errors;				//calls that returned an error
+	unsigned long total_ns;				//time spent in all of the calls
+	unsigned long hist[STATS_BUCKETS];	//calls that took [2^i, 2^(i+1)) ns
+} __attribute__((aligned(64)));
+
+static struct cs1550_op_stats op_stats[OP_COUNT];
+
+// How much .disk had to be read and written for what was asked of us.
+// Reads the block cache answers don't count, and neither do pages of
+// the mapping the kernel faults in for the directories and the table.
+// Syncing a block is charged to whatever dirtied it, not to the flush
+// or fsync that happened to send it out.
+struct cs1550_io_stats {
+	unsigned long logical;			//bytes the operation itself read or wrote
+	unsigned long physical_read;	//bytes read from .disk
+	unsigned long physical_written;	//bytes synced out to .disk
+	unsigned long requests;			//reads and syncs sent to .disk
+} __attribute__((aligned(64)));
+
+static struct cs1550_io_stats io_stats[IO_SOURCES];
+
+// How often a name was looked up in the index and found or not. A
+// miss never goes to .disk, since the index holds every name there
+// is, so this shows how much of the lookup traffic is for paths that
+// don't exist.
+enum cs1550_lookup { LOOKUP_DIRECTORY, LOOKUP_FILE, LOOKUP_COUNT };
+
+static const char* lookup_names[LOOKUP_COUNT] = { "directory", "file" };
+
+struct cs1550_lookup_stats {
+	unsigned long hits;
+	unsigned long misses;
+} __attribute__((aligned(64)));
+
+static struct cs1550_lookup_stats lookup_stats[LOOKUP_COUNT];
+
+// Count a lookup of kind that found something or not
+static void lookup_record(enum cs1550_lookup kind, int found) {
+	__atomic_add_fetch(found ? &lookup_stats[kind].hits : &lookup_stats[kind].misses, 1, __ATOMIC_RELAXED);
 }
 
-/*
- * Deletes a file
- */
-static int cs1550_unlink(const char *path)
-{
-    (void) path;
-
-    return 0;
-}
+// What the block cache did, in blocks
+struct cs1550_bcache_stats {
+	unsigned long hits;			//found in the cache
+	unsigned long misses;		//had to come from the image
+	unsigned long evictions;	//thrown out to make room
+	unsigned long readahead;	//brought in ahead of a read
+} __attribute__((aligned(64)));
 
-/* 
- * Read size bytes from file into buf starting from offset
- *
- */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-			  struct fuse_file_info *fi)
-{
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
+static struct cs1550_bcache_stats bcache_stats;
 
-	//check to make sure path exists
-	//check that size is > 0
-	//check that offset is <= to the file size
-	//read in data
-	//set size and return, or error
+// What the I/O this thread does right now gets charged to
+static __thread int io_source = IO_BACKGROUND;
 
-	//size = 0;
-	// Variables to store the path, file, and extension
-	char* dir;
-	char* file_name;	
-	char* ext;	
+// Nanoseconds on a clock that never goes backwards
+static uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
+// Start timing a call to op, and charge this thread's I/O to it
+static uint64_t stats_begin(enum cs1550_op op) {
+	io_source = op;
+	return stats_now();
+}
 
-	// Parse path using strtok
-	dir = strtok(path, "/");
-	file_name = strtok(NULL, ".");
-	ext = strtok(NULL, ".");
+// Count a call to op that started at start and returned res, and
+// give back how long it took
+static uint64_t stats_record(enum cs1550_op op, uint64_t start, int res) {
+	uint64_t ns = stats_now() - start;
+	struct cs1550_op_stats* s = &op_stats[op];
+	io_source = IO_BACKGROUND;
 
-	// Check if we were given an empty directory
-	if((dir && dir[0]) && strcmp(dir, "") != 0) {
-		//Read in the root and bitmap
-		// Variables to store root directory and file
-		// allocation table
-		cs1550_root_directory root_dir = get_root_dir();
-		cs1550_bitmap bitmap = get_bitmap();
+	// What read and write return is how much they moved
+	if((op == OP_READ || op == OP_WRITE) && res > 0) {
+		__atomic_add_fetch(&io_stats[op].logical, res, __ATOMIC_RELAXED);
+	}
 
-		struct cs1550_directory directory;
+	// The bucket is the highest bit set in the latency
+	int bucket = 63 - __builtin_clzll(ns | 1);
+	if(bucket >= STATS_BUCKETS) {
+		bucket = STATS_BUCKETS - 1;
+	}
 
-		int i = 0;
-		// Go through every directory in root
-		for(i = 0; i < MAX_DIRS_IN_ROOT; i++) {
-			
-			// Check if the current directory is the one
-			// we want
-			if(strcmp(dir, root_dir.directories[i].dname) == 0) {
-				// If it is, then store it to be used later
-				directory = root_dir.directories[i];
-				break;
-			}
-		}
+	__atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+	if(res < 0) {
+		__atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&s->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->hist[bucket], 1, __ATOMIC_RELAXED);
+	return ns;
+}
 
-		// Check if the directory that was found has a name
-		if(strcmp(directory.dname, "") != 0) {
-			// Read in disk file and caluclate
-			// offset at whcih to fine the block
-			// we need
-			long disk_location = BLOCK_SIZE * directory.nStartBlock;
-			FILE* disk = fopen(".disk", "r+b");
-			fseek(disk, disk_location, SEEK_SET);
-			
-			// Variable to store the directory we
-			// want from the .disk file
-			cs1550_directory_entry entry;
-			int items_read = fread(&entry, BLOCK_SIZE, 1, disk);
-			fclose(disk);
-
-			// Check if anything was read in
-			if(items_read) {
-				// If it was it's time to find the file we want
-				struct cs1550_file_directory file_directory;
-
-				int j = 0;
-				// Search the files int eh directory until we
-				// find thee one we want
-				for(j = 0; j < MAX_FILES_IN_DIR; j++) {
-
-					// Check if the current file 
-					// matches the name of the one we 
-					// want to read
-					if(strcmp(entry.files[j].fname, file_name) == 0) {
-						// If it is, then we need to
-						// check the extension on the current
-						// file to see if that also matches
-						if(ext && ext[0]) {
-							// If the extension for the 
-							// file we want is not empty
-							// then check if the current file
-							// matches it
-							if(strcmp(entry.files[j].fext, ext) == 0) {
-								// The extension matches, so this is
-								// the file that we want to read
-								file_directory = entry.files[j];
-								break;
-							}
-						} else {
-							// The extension we want is empty, so
-							// we need to check if the current file
-							// extension is also empty
-							if(strcmp(entry.files[j].fext, "") == 0) {
-								// It matches, so store the file
-								// to be read
-								file_directory = entry.files[j];
-								break;
-							}
-						}
-					}
-				}
+// Charge I/O to .disk to one source
+static void io_charge(int source, unsigned long read, unsigned long written, unsigned long requests) {
+	struct cs1550_io_stats* s = &io_stats[source];
+	__atomic_add_fetch(&s->physical_read, read, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->physical_written, written, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->requests, requests, __ATOMIC_RELAXED);
+}
 
-				// Check if the file we found has
-				// no name
-				if(strcmp(file_directory.fname, "") != 0) {
-					// We need to find the right offset to read from
-					int block_num = 0;
-					if(offset != 0) {
-						block_num = offset/BLOCK_SIZE;
-					} 
-					int block_offset = 0;
-					if(offset != 0) {
-						block_offset = offset - (block_num * BLOCK_SIZE);
-					} 
-
-					// Get the current block we're using
-					// and iterate through the bitmap
-					// until we get the one we want
-					int block = file_directory.nStartBlock;
-					if(block_num != 0) {
-						while(block_num > 0){
-							block = bitmap.table[block];
-							block_num--;
-						}
-					}
-
-					// Open .disk to read the data from the blocks of the file
-					FILE* disk = fopen(".disk", "r+b");
-					fseek(disk, (BLOCK_SIZE * block) + block_offset, SEEK_SET);
-					cs1550_disk_block read_block;
-					fread(&read_block.data, BLOCK_SIZE - block_offset, 1, disk);
-					int buf_size = 0;
-
-					// Add the new block's data to the buffer
-					if(file_directory.fsize >= BLOCK_SIZE) {
-						memcpy(buf, &read_block.data, BLOCK_SIZE - block_offset);
-					} else {
-						memcpy(buf, &read_block.data, file_directory.fsize);
-					}
-
-					// Change size of the buffer
-					buf_size = BLOCK_SIZE - block_offset;
-
-					//While this file hasn't ended yet and there are still more block sto read in, repeat the above procedure and keep iterating through the blocks of the file until EOF is reached
-					// Go through every block in the allocation table
-					// until we reach the end of the file
-					while(bitmap.table[block] != EOF){
-						// Get the current block
-						block = bitmap.table[block];
-						// Variable to store current block
-						// in buffer
-						cs1550_disk_block block_data;
-						// Seek to the space reserved for this block 
-						// in the .disk file
-						fseek(disk, (BLOCK_SIZE * block), SEEK_SET);
-						// Read in the block's data
-						fread(&block_data.data, BLOCK_SIZE, 1, disk);
-						memcpy(buf + buf_size, &block_data, strlen(block_data.data));
-						// Increase buffer size
-						buf_size += strlen(block_data.data);
-					}
-					fclose(disk);
-
-					// Write new root directory and new
-					// bitmap back to .disk
-					write_new_root(&root_dir);
-					write_new_bitmap(&bitmap);
-					size = buf_size;
-				} else { 
-					// No filename provided and we
-					// can't read from a directory
-					return -EISDIR;
-				}
-			}
+// Charge n pieces of I/O to .disk to whatever this thread is doing
+static void io_account(const struct cs1550_io* ios, int n) {
+	unsigned long read = 0, written = 0;
+	int i = 0;
+	for(i = 0; i < n; i++) {
+		if(ios[i].op == IO_READ) {
+			read += ios[i].len;
 		} else {
-			// Directory name was empty or null,
-			// so just return
-			return 0;
-		}	
+			written += ios[i].len;
+		}
 	}
-	return size;
+	io_charge(io_source, read, written, n);
 }
 
-/* 
- * Write size bytes from buf into file starting from offset
- *
- */
-static int cs1550_write(const char *path, const char *buf, size_t size, 
-			  off_t offset, struct fuse_file_info *fi)
-{
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
-
-	//path will be in the format of /directory/sub_directory
-	char* dir; //The first directory in the 2-level file system
-	char* file_name; //The directory within the root's directory	
-	char* ext;	
-
-	dir = strtok(path, "/");
-	file_name = strtok(NULL, ".");
-	ext = strtok(NULL, ".");
+// Copy out the I/O counters of one source, or the sum of all of
+// them if source is -1
+static void io_stats_get(int source, struct cs1550_io_stats* out) {
+	memset(out, 0, sizeof(*out));
+	int i = 0;
+	for(i = 0; i < IO_SOURCES; i++) {
+		if(source >= 0 && i != source) {
+			continue;
+		}
+		out->logical += __atomic_load_n(&io_stats[i].logical, __ATOMIC_RELAXED);
+		out->physical_read += __atomic_load_n(&io_stats[i].physical_read, __ATOMIC_RELAXED);
+		out->physical_written += __atomic_load_n(&io_stats[i].physical_written, __ATOMIC_RELAXED);
+		out->requests += __atomic_load_n(&io_stats[i].requests, __ATOMIC_RELAXED);
+	}
+}
 
-	// Check if we were given an empty directory
-	if((dir && dir[0]) && strcmp(dir, "") != 0) { 
-		// Variables to store the root directory
-		// and to store the bitmap
-		cs1550_root_directory root_dir = get_root_dir();
-		cs1550_bitmap bitmap = get_bitmap();
+// Write one source's I/O counters as a line of text, with how many
+// bytes of .disk it took for every byte asked for
+static int io_stats_line(char* buf, size_t size, const char* name, struct cs1550_io_stats* s) {
+	int len = snprintf(buf, size, "%s %lu %lu %lu %lu", name, s->logical,
+			s->physical_read, s->physical_written, s->requests);
+	if(s->logical > 0) {
+		len += snprintf(buf + len, size - len, " %.2f\n",
+				(double) (s->physical_read + s->physical_written) / s->logical);
+	} else {
+		len += snprintf(buf + len, size - len, " -\n");
+	}
+	return len;
+}
 
-		struct cs1550_directory directory;
+// Is this the path the stats are read from. A call through the handle
+// of a file that's been unlinked comes with no path at all.
+static int stats_path(const char* path) {
+	return path != NULL && strcmp(path, STATS_PATH) == 0;
+}
 
+// Write the stats out as text into buf, which holds STATS_SIZE bytes,
+// and give back how long it is. There is a line for every operation
+// with its calls, errors and total time, then how many calls landed
+// in each latency bucket, followed by the I/O, lookup and block cache
+// counters.
+static int stats_render(char* buf) {
+	int len = snprintf(buf, STATS_SIZE,
+			"# op calls errors total_us, then calls taking [2^i, 2^(i+1)) ns for i = 0..%d\n",
+			STATS_BUCKETS - 1);
+
+	int op = 0;
+	for(op = 0; op < OP_COUNT; op++) {
+		struct cs1550_op_stats* s = &op_stats[op];
+		len += snprintf(buf + len, STATS_SIZE - len, "%s %lu %lu %lu", op_names[op],
+				__atomic_load_n(&s->calls, __ATOMIC_RELAXED),
+				__atomic_load_n(&s->errors, __ATOMIC_RELAXED),
+				__atomic_load_n(&s->total_ns, __ATOMIC_RELAXED) / 1000);
 		int i = 0;
-		// Go through all the entries in root directory 
-		for(i = 0; i < MAX_DIRS_IN_ROOT; i++) {
-			// Check if the current directory is
-			// the one we want
-			if(strcmp(dir, root_dir.directories[i].dname) == 0) {
-				// If it is, store it to be used
-				directory = root_dir.directories[i];
-				break;
-			}
+		for(i = 0; i < STATS_BUCKETS; i++) {
+			len += snprintf(buf + len, STATS_SIZE - len, " %lu",
+					__atomic_load_n(&s->hist[i], __ATOMIC_RELAXED));
 		}
+		len += snprintf(buf + len, STATS_SIZE - len, "\n");
+	}
 
-		// Check if a directory was found
-		if(strcmp(directory.dname, "") != 0) {
-			// Get directory location to find it in .disk
-			long disk_location = BLOCK_SIZE * directory.nStartBlock;
-
-			// Open up disk file and set our file position
-			// based on the calculated disk location
-			FILE* disk = fopen(".disk", "r+b");
-			fseek(disk, disk_location, SEEK_SET);	
-			// Variable to store our directory
-			// that we got from .disk
-			cs1550_directory_entry entry;
-			int num_items = fread(&entry, BLOCK_SIZE, 1, disk);
-			fclose(disk);
-
-			// Check if a block was read
-			if(num_items) {
-				// If it was we can begin the long and arudous
-				// project of writing to it
-				struct cs1550_file_directory file_directory;
-				int file_index = -1;
-
-				int j = 0;
-				// Need to go through every file in the directory
-				for(j = 0; j < MAX_FILES_IN_DIR; j++) {
-
-					// Check if the current file matches the one we want
-					if(strcmp(entry.files[j].fname, file_name) == 0) {
-						// Check if the file extension is empty
-						if(ext && ext[0]){ //Check whether the file we're looking for has a file extension or not; if true, it does
-							// If it is not empty then check if the 
-							// extension matches the one we're looking for
-							if(strcmp(entry.files[j].fext, ext) == 0) {
-								// Store the file directory and it's location 
-								// because we've found a match
-								file_directory = entry.files[j];
-								file_index = j;
-								break;
-							}
-						} else {
-							// The file we're looking for does not have an extension
-							// So now check if the current file has a blank extension
-							if(strcmp(entry.files[j].fext, "") == 0) {
-								// Store the file directory and it's location 
-								// because we've found a match
-								file_directory = entry.files[j];
-								file_index = j;
-								break;
-							}
-						}
-					}
-				}
-
-				// Check whether the file name is empty
-				if(strcmp(file_directory.fname, "") != 0) {
-					// Check if the offset is bigger than our file size
-					if(offset > file_directory.fsize) {
-						// It is, so return an error
-						return -EFBIG;
-					}
-					
-					// Get the buffer size and then get
-					// the number of bytes we need until we can 
-					// append to the file
-					int buf_size = strlen(buf);
-					int bytes_to_append = file_directory.fsize - offset;
-					
-					// We need to figure out what blocks we have to skip 
-					// in order to write to the desired location
-					int block_num = 0;
-					if(offset != 0) {
-						block_num = offset/BLOCK_SIZE;
-					} 
-					int block_offset = 0;
-					if(offset != 0) {
-						block_offset = offset - (block_num * BLOCK_SIZE);
-					} 
-
-					// Need to move through the map until
-					// we find the correct starting block
-					int block = file_directory.nStartBlock;
-					if(block_num != 0){
-						while(block_num > 0){
-							block = bitmap.table[block];
-							block_num--;
-						}
-					}
-
-					// Bytes needed to write to disk
-					int bytes_left = buf_size;
-
-					//Open the disk and write the correct about of buffer data in the first block; this basically gets rid of the offset so we can then start writing entire Blocks at a time later
-					// Open .disk and seek to the correct location
-					FILE* disk = fopen(".disk", "r+b");
-					fseek(disk, (BLOCK_SIZE * block) + block_offset, SEEK_SET);
-					// Check if the buffer has more in it
-					// than a block will allow 
-					if(buf_size >= BLOCK_SIZE) { //This means there will be left over stuff in the buffer that we have to write after we finish writing to this block
-						// Write the data in buffer to disk
-						fwrite(buf, BLOCK_SIZE - block_offset, 1, disk);
-						// Subtract from our btes left now
-						// that we've written a few things
-						bytes_left -= (BLOCK_SIZE - block_offset);
-						if(offset == size) {
-							// Expand file size based on the offset
-							file_directory.fsize = offset+1;
-						}
-					} else { 
-						// We aren't overflowing, so write this 
-						// to .disk, lets get this bread!
-						fwrite(buf, buf_size, 1, disk);
-
-						// Need to pad to our remaining spaces						
-						char pad[BLOCK_SIZE-buf_size];
-						int h = 0;
-						// Fill a pad array with  null terminators
-						for(h = 0; h < BLOCK_SIZE-buf_size; h++){
-							pad[h] = '\0';
-						}
-						// Write our pad to the file
-						fwrite(pad, BLOCK_SIZE-buf_size, 1, disk);
-						bytes_left -= buf_size;
-
-						// Check if fsize is greater than
-						// size
-						if(file_directory.fsize > size) {
-							if(offset == size){
-								// Expand our file size based on 
-								// our offset
-								file_directory.fsize = offset+1;
-							} else {
-								// Set fsize = size
-								file_directory.fsize = size;
-							}
-						}
-					}		
-
-					// If there are any bytes left
-					// then we need to continue writing
-					while(bytes_left > 0) { 
-						
-						// Check if we have room in the file
-						if(bitmap.table[block] == EOF) {
-							int k = 2;
-							// Search through our bitmap
-							for(k = 2; k < MAX_MAP_ENTRIES; k++) { //We need to allocate another block for this file to write more bytes; find a new block in the bitmap
-								// Need to allocate another block for this file
-								// so we need to find a block to write too
-								// Check if the current block is allocated
-								if(bitmap.table[k] == 0) {
-									// If our current block is unallocated,
-									// then we need to allocate it
-									bitmap.table[block] = k;
-									bitmap.table[k] = EOF;
-									block = k;
-									break;
-								}
-							}
-						} else { 
-							// We still have room, so continue writing into the next block
-							block = bitmap.table[block];
-						}
-
-						// Seek to a new position so we 
-						// can write the new file stuff into
-						// .disk
-						fseek(disk, BLOCK_SIZE * block, SEEK_SET);
-						// Check if there still is more data to write
-						if(bytes_left >= BLOCK_SIZE) { 
-							// Get address of new block
-							char* new_addr = buf + (buf_size - bytes_left);
-							// Write to that address
-							fwrite(new_addr, BLOCK_SIZE, 1, disk);
-							// Update our bytes left
-							bytes_left -= BLOCK_SIZE;
-						} else { //This is our final write because we don't have anything left in the buffer to write; so just write it and finish
-							// Nothing is left in the buffer that 
-							// we need to write, so finish this
-							// file out
-							char* new_addr = buf + (buf_size - bytes_left);
-							fwrite(new_addr, bytes_left, 1, disk);
-
-							// All done!
-							bytes_left = 0;
-						}
-					}
-			
-					// Figure out how many bytes have been appended out of the 
-					// ones we need
-
-					int appended_bytes = bytes_to_append - buf_size - bytes_left;
-					if(appended_bytes > 0) {
-						// if there still is stuff to append, 
-						// alter file size accordingly
-						file_directory.fsize += appended_bytes;
-					}
-
-					// Add our file to the list of 
-					// files in the directory
-					entry.files[file_index] = file_directory;
-					// Seek to the appropriate
-					// spot in .disk
-					fseek(disk, directory.nStartBlock * BLOCK_SIZE, SEEK_SET);
-					// Write our appended file directory
-					// to .disk
-					fwrite(&entry, BLOCK_SIZE, 1, disk);
-					fclose(disk);
-
-					write_new_root(&root_dir);
-					write_new_bitmap(&bitmap);
-					size = buf_size;
-				}
-			} 
+	len += snprintf(buf + len, STATS_SIZE - len,
+			"# source logical_bytes read_bytes written_bytes requests amplification\n");
+	struct cs1550_io_stats s;
+	int i = 0;
+	for(i = 0; i < IO_SOURCES; i++) {
+		io_stats_get(i, &s);
+		len += io_stats_line(buf + len, STATS_SIZE - len, op_names[i], &s);
+	}
+	io_stats_get(-1, &s);
+	len += io_stats_line(buf + len, STATS_SIZE - len, "total", &s);
+
+	len += snprintf(buf + len, STATS_SIZE - len, "# lookup hits misses miss_ratio\n");
+	for(i = 0; i < LOOKUP_COUNT; i++) {
+		unsigned long hits = __atomic_load_n(&lookup_stats[i].hits, __ATOMIC_RELAXED);
+		unsigned long misses = __atomic_load_n(&lookup_stats[i].misses, __ATOMIC_RELAXED);
+		len += snprintf(buf + len, STATS_SIZE - len, "%s %lu %lu", lookup_names[i], hits, misses);
+		if(hits + misses > 0) {
+			len += snprintf(buf + len, STATS_SIZE - len, " %.2f\n", (double) misses / (hits + misses));
+		} else {
+			len += snprintf(buf + len, STATS_SIZE - len, " -\n");
 		}
 	}
-	return size;
+
+	unsigned long hits = __atomic_load_n(&bcache_stats.hits, __ATOMIC_RELAXED);
+	unsigned long misses = __atomic_load_n(&bcache_stats.misses, __ATOMIC_RELAXED);
+	len += snprintf(buf + len, STATS_SIZE - len, "# cache hits misses evictions readahead miss_ratio\n");
+	len += snprintf(buf + len, STATS_SIZE - len, "blocks %lu %lu %lu %lu", hits, misses,
+			__atomic_load_n(&bcache_stats.evictions, __ATOMIC_RELAXED),
+			__atomic_load_n(&bcache_stats.readahead, __ATOMIC_RELAXED));
+	if(hits + misses > 0) {
+		len += snprintf(buf + len, STATS_SIZE - len, " %.2f\n", (double) misses / (hits + misses));
+	} else {
+		len += snprintf(buf + len, STATS_SIZE - len, " -\n");
+	}
+	return len;
 }
 
-/******************************************************************************
- *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
- *
- *****************************************************************************/
+// Tracing. With -o trace=FILE every call that comes in through
+// hello_oper is written to FILE as it finishes: which operation, its
+// path, offset, size and handle, when it started, how long it took and
+// what it returned. Records are gathered in memory and written out a
+// buffer at a time, so a traced call costs a copy and a lock. The file
+// can be played back against another image with cs1550_replay.
+#define TRACE_MAGIC "CS1550TR"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER (256 * 1024)
+
+struct cs1550_trace_header {
+	char magic[8];		//TRACE_MAGIC
+	uint32_t version;	//TRACE_VERSION
+	uint32_t reserved;
+};
 
-/*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
+// One call. The path follows it, path_len bytes with no nul.
+struct cs1550_trace_record {
+	uint64_t start;		//ns after the trace began
+	uint64_t fh;		//handle the call went through, 0 for none
+	int64_t offset;		//for read, write and readdir, the new size for truncate
+	uint32_t size;		//bytes for read and write, mode for mkdir and mknod, datasync for fsync
+	uint32_t latency;	//ns, up to about 4s
+	int32_t result;		//what the call returned
+	uint16_t op;		//enum cs1550_op
+	uint16_t path_len;
+} __attribute__((packed));
+
+struct cs1550_trace {
+	int fd;				//where the trace goes, -1 when not tracing
+	uint64_t epoch;		//when tracing started
+	pthread_mutex_t lock;
+	char* buf;			//records not written out yet
+	size_t used;
+};
+
+static struct cs1550_trace trace = { -1, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+// Write out everything in the buffer, with the lock held
+static void trace_flush_locked() {
+	size_t done = 0;
+	while(done < trace.used) {
+		ssize_t n = write(trace.fd, trace.buf + done, trace.used - done);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		} else if(n <= 0) {
+			//the rest of the trace is lost, but the filesystem carries on
+			fprintf(stderr, "cs1550: writing the trace failed, stopping it\n");
+			close(trace.fd);
+			__atomic_store_n(&trace.fd, -1, __ATOMIC_RELAXED);
+			break;
+		}
+		done += n;
+	}
+	trace.used = 0;
+}
+
+// Start tracing into path
+static int trace_open(const char* path) {
+	trace.buf = malloc(TRACE_BUFFER);
+	if(trace.buf == NULL) {
+		return -ENOMEM;
+	}
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		int err = -errno;
+		free(trace.buf);
+		trace.buf = NULL;
+		return err;
+	}
+
+	struct cs1550_trace_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	memcpy(trace.buf, &header, sizeof(header));
+	trace.used = sizeof(header);
+	trace.epoch = stats_now();
+	__atomic_store_n(&trace.fd, fd, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// Write out what's left and stop tracing
+static void trace_close() {
+	pthread_mutex_lock(&trace.lock);
+	if(trace.fd >= 0) {
+		trace_flush_locked();
+	}
+	if(trace.fd >= 0) {
+		close(trace.fd);
+		__atomic_store_n(&trace.fd, -1, __ATOMIC_RELAXED);
+	}
+	free(trace.buf);
+	trace.buf = NULL;
+	trace.used = 0;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+// What identifies the handle a call went through
+static uint64_t trace_fh(struct fuse_file_info* fi) {
+	return fi != NULL ? fi->fh : 0;
+}
+
+// Add a call that started at start and took ns to the trace
+static void trace_record(enum cs1550_op op, const char* path, int64_t offset, uint32_t size,
+		uint64_t fh, uint64_t start, uint64_t ns, int res) {
+	//checked again under the lock, this just keeps it cheap when off
+	if(__atomic_load_n(&trace.fd, __ATOMIC_RELAXED) < 0) {
+		return;
+	}
+
+	struct cs1550_trace_record r;
+	size_t len = path != NULL ? strlen(path) : 0;
+	if(len > PATH_MAX) {
+		len = PATH_MAX;
+	}
+	r.start = start - trace.epoch;
+	r.fh = fh;
+	r.offset = offset;
+	r.size = size;
+	r.latency = ns > UINT32_MAX ? UINT32_MAX : ns;
+	r.result = res;
+	r.op = op;
+	r.path_len = len;
+
+	pthread_mutex_lock(&trace.lock);
+	if(trace.fd >= 0) {
+		if(trace.used + sizeof(r) + len > TRACE_BUFFER) {
+			trace_flush_locked();
+		}
+		memcpy(trace.buf + trace.used, &r, sizeof(r));
+		memcpy(trace.buf + trace.used + sizeof(r), path, len);
+		trace.used += sizeof(r) + len;
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+// Do one piece of I/O right here with a plain system call
+static int io_do(struct cs1550_io* io) {
+	if(io->op == IO_READ) {
+		return disk_read(io->buf, io->len, io->pos);
+	}
+	if(disk.map == NULL || io->pos < 0 || io->pos + io->len > disk.size) {
+		return -EIO;
+	}
+	if(msync(disk.map + io->pos, io->len, MS_SYNC) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int pread_init() {
+	return 0;
+}
+
+static void pread_fini() {
+}
+
+static int pread_submit(struct cs1550_io* ios, int n) {
+	int res = 0;
+	int i = 0;
+	for(i = 0; i < n; i++) {
+		int r = io_do(&ios[i]);
+		if(r < 0) {
+			res = r;
+		}
+	}
+	return res;
+}
+
+static const struct cs1550_io_backend pread_backend = { "pread", pread_init, pread_fini, pread_submit };
+
+// An io_uring set up with raw system calls: the submission ring, the
+// completion ring and the submission entries are all mapped from the
+// ring's descriptor. A ring is only used by one thread at a time, so
+// idle ones are kept in a pool and a thread that finds it empty just
+// sets up another.
+#define URING_ENTRIES 64
+
+struct cs1550_ring {
+	int fd;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	unsigned nEntries;				//how many submissions fit
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_map;					//mapping that holds the submission ring
+	size_t sq_size;
+	void* cq_map;					//mapping that holds the completion ring
+	size_t cq_size;
+	size_t sqes_size;
+	struct cs1550_ring* next;		//next idle ring in the pool
+};
+
+struct cs1550_ring_pool {
+	struct cs1550_ring* idle;	//rings nobody is using
+	pthread_mutex_t lock;		//held while taking a ring or putting one back
+};
+
+static struct cs1550_ring_pool rings = { NULL, PTHREAD_MUTEX_INITIALIZER };
+
+// Tear a ring down
+static void ring_close(struct cs1550_ring* r) {
+	if(r->sqes != NULL) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	if(r->cq_map != NULL && r->cq_map != r->sq_map) {
+		munmap(r->cq_map, r->cq_size);
+	}
+	if(r->sq_map != NULL) {
+		munmap(r->sq_map, r->sq_size);
+	}
+	close(r->fd);
+	free(r);
+}
+
+// Set up a new ring, or return NULL if io_uring can't be used here
+static struct cs1550_ring* ring_open() {
+	struct cs1550_ring* r = calloc(1, sizeof(struct cs1550_ring));
+	if(r == NULL) {
+		return NULL;
+	}
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(r->fd < 0) {
+		free(r);
+		return NULL;
+	}
+
+	// Map the two rings, which newer kernels put in one mapping
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(r->cq_size > r->sq_size) {
+			r->sq_size = r->cq_size;
+		}
+		r->cq_size = r->sq_size;
+	}
+	r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_map == MAP_FAILED) {
+		r->sq_map = NULL;
+		ring_close(r);
+		return NULL;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cq_map == MAP_FAILED) {
+			r->cq_map = NULL;
+			ring_close(r);
+			return NULL;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		ring_close(r);
+		return NULL;
+	}
+
+	// Find the fields of the rings we need
+	char* sq = r->sq_map;
+	char* cq = r->cq_map;
+	r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*) (sq + p.sq_off.array);
+	r->cq_head = (unsigned*) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	r->nEntries = p.sq_entries;
+	return r;
+}
+
+// Take an idle ring from the pool, or set up a new one
+static struct cs1550_ring* ring_get() {
+	pthread_mutex_lock(&rings.lock);
+	struct cs1550_ring* r = rings.idle;
+	if(r != NULL) {
+		rings.idle = r->next;
+	}
+	pthread_mutex_unlock(&rings.lock);
+	return r != NULL ? r : ring_open();
+}
+
+// Put a ring back in the pool
+static void ring_put(struct cs1550_ring* r) {
+	pthread_mutex_lock(&rings.lock);
+	r->next = rings.idle;
+	rings.idle = r;
+	pthread_mutex_unlock(&rings.lock);
+}
+
+// Submit up to a ring's worth of I/O and wait for all of it. Anything
+// the kernel couldn't do (a short read, an op it doesn't know) is
+// finished off with io_do. Returns -1 if the ring itself broke, in
+// which case nothing has been submitted.
+static int ring_run(struct cs1550_ring* r, struct cs1550_io* ios, int n, int* res) {
+	// Fill in a submission entry for each piece of I/O
+	unsigned tail = *r->sq_tail;
+	int i = 0;
+	for(i = 0; i < n; i++) {
+		unsigned idx = (tail + i) & *r->sq_mask;
+		struct io_uring_sqe* sqe = &r->sqes[idx];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->fd = disk.fd;
+		sqe->off = ios[i].pos;
+		sqe->len = ios[i].len;
+		sqe->user_data = i;
+		if(ios[i].op == IO_READ) {
+			sqe->opcode = IORING_OP_READ;
+			sqe->addr = (unsigned long) ios[i].buf;
+		} else {
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		}
+		r->sq_array[idx] = idx;
+	}
+	__atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+	// Hand them all over and wait for them to finish
+	int to_submit = n;
+	int done = 0;
+	while(done < n) {
+		int ret = syscall(__NR_io_uring_enter, r->fd, to_submit, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0 && errno != EINTR && to_submit == n) {
+			return -1;
+		} else if(ret > 0) {
+			to_submit -= ret < to_submit ? ret : to_submit;
+		}
+
+		// Collect whatever has finished
+		unsigned head = *r->cq_head;
+		while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+			struct cs1550_io* io = &ios[cqe->user_data];
+			int ok = io->op == IO_READ ? cqe->res == (int) io->len : cqe->res == 0;
+			if(!ok) {
+				// Finish what the kernel didn't, the plain way
+				struct cs1550_io rest = *io;
+				if(io->op == IO_READ && cqe->res > 0) {
+					rest.buf += cqe->res;
+					rest.len -= cqe->res;
+					rest.pos += cqe->res;
+				}
+				int r2 = io_do(&rest);
+				if(r2 < 0) {
+					*res = r2;
+				}
+			}
+			head++;
+			done++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+// Check that a ring can be set up before saying io_uring is usable
+static int uring_init() {
+	struct cs1550_ring* r = ring_open();
+	if(r == NULL) {
+		return -ENOSYS;
+	}
+	ring_put(r);
+	return 0;
+}
+
+// Tear down every ring in the pool
+static void uring_fini() {
+	pthread_mutex_lock(&rings.lock);
+	while(rings.idle != NULL) {
+		struct cs1550_ring* r = rings.idle;
+		rings.idle = r->next;
+		ring_close(r);
+	}
+	pthread_mutex_unlock(&rings.lock);
+}
+
+static int uring_submit(struct cs1550_io* ios, int n) {
+	struct cs1550_ring* r = ring_get();
+	if(r == NULL) {
+		return pread_submit(ios, n);
+	}
+
+	// A ring only holds so many at once
+	int res = 0;
+	int i = 0;
+	while(i < n) {
+		int count = n - i < (int) r->nEntries ? n - i : (int) r->nEntries;
+		if(ring_run(r, ios + i, count, &res) < 0) {
+			// The ring is no good, so do the rest without it
+			ring_close(r);
+			int r2 = pread_submit(ios + i, n - i);
+			return r2 < 0 ? r2 : res;
+		}
+		i += count;
+	}
+	ring_put(r);
+	return res;
+}
+
+static const struct cs1550_io_backend uring_backend = { "uring", uring_init, uring_fini, uring_submit };
+
+// The backend in use, picked at mount
+static const struct cs1550_io_backend* io_backend = &pread_backend;
+
+// Pick a backend from the io mount option, falling back to pread
+// if the one asked for can't be set up
+static void io_select() {
+	io_backend = &pread_backend;
+	if(options.io != NULL && strcmp(options.io, "pread") == 0) {
+		return;
+	}
+	if(options.io != NULL && strcmp(options.io, "uring") != 0) {
+		fprintf(stderr, "cs1550: unknown io backend %s, using pread\n", options.io);
+		return;
+	}
+	if(uring_backend.init() == 0) {
+		io_backend = &uring_backend;
+	} else {
+		fprintf(stderr, "cs1550: io_uring is not available, using pread\n");
+	}
+}
+
+// A batch of I/O for one operation. Small batches live right in here
+// and bigger ones spill over onto the heap.
+#define IO_BATCH_LOCAL 16
+
+struct cs1550_io_batch {
+	struct cs1550_io* ios;
+	int nIos;
+	int cap;
+	struct cs1550_io local[IO_BATCH_LOCAL];
+};
+
+static void io_batch_init(struct cs1550_io_batch* b) {
+	b->ios = b->local;
+	b->nIos = 0;
+	b->cap = IO_BATCH_LOCAL;
+}
+
+// Add a piece of I/O to a batch
+static int io_batch_add(struct cs1550_io_batch* b, int op, char* buf, size_t len, off_t pos) {
+	// Split anything too long for the backend to take at once
+	while(len > IO_MAX_LEN) {
+		int res = io_batch_add(b, op, buf, IO_MAX_LEN, pos);
+		if(res < 0) {
+			return res;
+		}
+		buf = buf != NULL ? buf + IO_MAX_LEN : NULL;
+		len -= IO_MAX_LEN;
+		pos += IO_MAX_LEN;
+	}
+
+	if(b->nIos == b->cap) {
+		struct cs1550_io* ios = malloc(b->cap * 2 * sizeof(struct cs1550_io));
+		if(ios == NULL) {
+			return -ENOMEM;
+		}
+		memcpy(ios, b->ios, b->nIos * sizeof(struct cs1550_io));
+		if(b->ios != b->local) {
+			free(b->ios);
+		}
+		b->ios = ios;
+		b->cap *= 2;
+	}
+	struct cs1550_io* io = &b->ios[b->nIos++];
+	io->op = op;
+	io->buf = buf;
+	io->len = len;
+	io->pos = pos;
+	return 0;
+}
+
+// Hand everything in a batch to the backend and wait for it
+static int io_batch_submit(struct cs1550_io_batch* b) {
+	if(b->nIos == 0) {
+		return 0;
+	}
+	io_account(b->ios, b->nIos);
+	return io_backend->submit(b->ios, b->nIos);
+}
+
+static void io_batch_free(struct cs1550_io_batch* b) {
+	if(b->ios != b->local) {
+		free(b->ios);
+	}
+	io_batch_init(b);
+}
+
+// Data block cache. Blocks that have been read are kept in memory so
+// reading them again never goes back to the image. Once it's full, a
+// CLOCK sweep picks what to throw out: every slot has a reference bit
+// that a hit sets, and the hand clears bits as it passes until it finds
+// a slot nobody has used since its last pass.
+struct cs1550_block_cache {
+	char* data;				//nSlots blocks of data
+	long* blocks;			//which block is in each slot, -1 if it's empty
+	long* next;				//next slot in the same bucket, -1 at the end
+	unsigned char* ref;		//set when a slot is used, cleared by the hand
+	long* buckets;			//first slot for each hash bucket, -1 if empty
+	long nSlots;			//how many blocks fit, 0 if there's no cache
+	long nBuckets;			//always a power of two
+	long hand;				//next slot the CLOCK sweep looks at
+	pthread_mutex_t lock;	//held while using any of the above
+};
+
+static struct cs1550_block_cache bcache;
+
+// Set up a block cache that uses about bytes of memory
+static int bcache_init(size_t bytes) {
+	memset(&bcache, 0, sizeof(bcache));
+	pthread_mutex_init(&bcache.lock, NULL);
+	bcache.nSlots = bytes / BLOCK_SIZE;
+	if(bcache.nSlots == 0) {
+		return 0;
+	}
+	bcache.nBuckets = 1;
+	while(bcache.nBuckets < bcache.nSlots) {
+		bcache.nBuckets *= 2;
+	}
+
+	bcache.data = malloc(bcache.nSlots * BLOCK_SIZE);
+	bcache.blocks = malloc(bcache.nSlots * sizeof(long));
+	bcache.next = malloc(bcache.nSlots * sizeof(long));
+	bcache.ref = calloc(bcache.nSlots, 1);
+	bcache.buckets = malloc(bcache.nBuckets * sizeof(long));
+	if(bcache.data == NULL || bcache.blocks == NULL || bcache.next == NULL ||
+			bcache.ref == NULL || bcache.buckets == NULL) {
+		//run without a cache rather than not at all
+		free(bcache.data);
+		free(bcache.blocks);
+		free(bcache.next);
+		free(bcache.ref);
+		free(bcache.buckets);
+		bcache.nSlots = 0;
+		return -ENOMEM;
+	}
+	memset(bcache.blocks, -1, bcache.nSlots * sizeof(long));
+	memset(bcache.buckets, -1, bcache.nBuckets * sizeof(long));
+	return 0;
+}
+
+// Throw the block cache away at unmount
+static void bcache_drop() {
+	free(bcache.data);
+	free(bcache.blocks);
+	free(bcache.next);
+	free(bcache.ref);
+	free(bcache.buckets);
+	pthread_mutex_destroy(&bcache.lock);
+	memset(&bcache, 0, sizeof(bcache));
+}
+
+// Find the slot holding a block, or -1. Called with the lock held.
+static long bcache_find(long block) {
+	long slot = bcache.buckets[block & (bcache.nBuckets - 1)];
+	while(slot >= 0 && bcache.blocks[slot] != block) {
+		slot = bcache.next[slot];
+	}
+	return slot;
+}
+
+// Take a slot out of its bucket and empty it. Called with the lock held.
+static void bcache_remove(long slot) {
+	long* link = &bcache.buckets[bcache.blocks[slot] & (bcache.nBuckets - 1)];
+	while(*link != slot) {
+		link = &bcache.next[*link];
+	}
+	*link = bcache.next[slot];
+	bcache.blocks[slot] = -1;
+}
+
+// Put a copy of a block in the cache, making room for it if we have to.
+// Called with the lock held.
+static void bcache_insert(long block, const char* data) {
+	long slot = bcache_find(block);
+	if(slot < 0) {
+		// Sweep for a slot that's empty or hasn't been used lately
+		while(bcache.blocks[bcache.hand] >= 0 && bcache.ref[bcache.hand]) {
+			bcache.ref[bcache.hand] = 0;
+			bcache.hand = (bcache.hand + 1) % bcache.nSlots;
+		}
+		slot = bcache.hand;
+		bcache.hand = (bcache.hand + 1) % bcache.nSlots;
+		if(bcache.blocks[slot] >= 0) {
+			bcache_remove(slot);
+			__atomic_add_fetch(&bcache_stats.evictions, 1, __ATOMIC_RELAXED);
+		}
+
+		// Hook it into its bucket
+		long b = block & (bcache.nBuckets - 1);
+		bcache.blocks[slot] = block;
+		bcache.next[slot] = bcache.buckets[b];
+		bcache.buckets[b] = slot;
+	}
+	memcpy(bcache.data + slot * BLOCK_SIZE, data, BLOCK_SIZE);
+	bcache.ref[slot] = 1;
+}
+
+// A block in the image was just written, so bring the cached copy up
+// to date if there is one
+static void bcache_update(long block) {
+	if(bcache.nSlots == 0) {
+		return;
+	}
+	pthread_mutex_lock(&bcache.lock);
+	long slot = bcache_find(block);
+	if(slot >= 0) {
+		memcpy(bcache.data + slot * BLOCK_SIZE, disk_block(block), BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&bcache.lock);
+}
+
+// A block was given back, so drop any copy of it we have
+static void bcache_forget(long block) {
+	if(bcache.nSlots == 0) {
+		return;
+	}
+	pthread_mutex_lock(&bcache.lock);
+	long slot = bcache_find(block);
+	if(slot >= 0) {
+		bcache_remove(slot);
+		bcache.ref[slot] = 0;
+	}
+	pthread_mutex_unlock(&bcache.lock);
+}
+
+// Bring blocks first up to last - 1 into the cache once they've been
+// read into buf, which holds the image from byte pos on for len bytes.
+// Blocks only partly inside buf are copied from the mapping instead.
+static void bcache_fill(long first, long last, const char* buf, size_t len, off_t pos) {
+	pthread_mutex_lock(&bcache.lock);
+	long k = 0;
+	for(k = first; k < last; k++) {
+		off_t start = (off_t) k * BLOCK_SIZE;
+		if(start >= pos && start + BLOCK_SIZE <= pos + (off_t) len) {
+			bcache_insert(k, buf + (start - pos));
+		} else {
+			bcache_insert(k, disk_block(k));
+		}
+	}
+	pthread_mutex_unlock(&bcache.lock);
+}
+
+// Read len bytes of the image starting at byte pos into buf, taking
+// whatever blocks we can from the cache. Each run of blocks that isn't
+// cached is added to the batch as one read, for bcache_fill_batch to
+// put in the cache once the batch is done.
+static int cached_read(struct cs1550_io_batch* batch, char* buf, size_t len, off_t pos) {
+	if(pos < 0 || pos + len > disk.size) {
+		return -EIO;
+	}
+	if(bcache.nSlots == 0) {
+		return io_batch_add(batch, IO_READ, buf, len, pos);
+	}
+
+	long first = pos / BLOCK_SIZE;
+	long end = (pos + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long miss = -1;	//first block of the run of misses we're in, if any
+	long k = 0;
+	for(k = first; k <= end; k++) {
+		// Copy the block out if it's cached
+		long slot = -1;
+		if(k < end) {
+			pthread_mutex_lock(&bcache.lock);
+			slot = bcache_find(k);
+			if(slot >= 0) {
+				off_t from = (off_t) k * BLOCK_SIZE > pos ? (off_t) k * BLOCK_SIZE : pos;
+				off_t to = (off_t) (k + 1) * BLOCK_SIZE < pos + (off_t) len ? (off_t) (k + 1) * BLOCK_SIZE : pos + (off_t) len;
+				memcpy(buf + (from - pos), bcache.data + slot * BLOCK_SIZE + (from - (off_t) k * BLOCK_SIZE), to - from);
+				bcache.ref[slot] = 1;
+				__atomic_add_fetch(&bcache_stats.hits, 1, __ATOMIC_RELAXED);
+			} else {
+				__atomic_add_fetch(&bcache_stats.misses, 1, __ATOMIC_RELAXED);
+			}
+			pthread_mutex_unlock(&bcache.lock);
+		}
+
+		// Start a run of misses, or finish one off once
+		// we get to a hit or run out of blocks
+		if(slot < 0 && k < end) {
+			if(miss < 0) {
+				miss = k;
+			}
+		} else if(miss >= 0) {
+			off_t from = (off_t) miss * BLOCK_SIZE > pos ? (off_t) miss * BLOCK_SIZE : pos;
+			off_t to = (off_t) k * BLOCK_SIZE < pos + (off_t) len ? (off_t) k * BLOCK_SIZE : pos + (off_t) len;
+			int res = io_batch_add(batch, IO_READ, buf + (from - pos), to - from, from);
+			if(res < 0) {
+				return res;
+			}
+			miss = -1;
+		}
+	}
+	return 0;
+}
+
+// Put every block a finished batch of reads brought in into the cache
+static void bcache_fill_batch(struct cs1550_io_batch* batch) {
+	if(bcache.nSlots == 0) {
+		return;
+	}
+	int i = 0;
+	for(i = 0; i < batch->nIos; i++) {
+		struct cs1550_io* io = &batch->ios[i];
+		bcache_fill(io->pos / BLOCK_SIZE, (io->pos + io->len + BLOCK_SIZE - 1) / BLOCK_SIZE, io->buf, io->len, io->pos);
+	}
+}
+
+// Writes to a file are gathered up in one of these and go into the image
+// together, so a file streamed in small pieces only has its blocks and
+// its size updated once per buffer instead of once per write. A buffer
+// holds a single run of the file, and belongs to the file's lock.
+#define WRITE_BUFFER_SIZE (128 * 1024)
+
+// No more than this much memory goes to write buffers. Past it, writes
+// to files that don't have a buffer yet go straight into the image.
+#define WRITE_BUFFER_LIMIT (16 * 1024 * 1024)
+
+struct cs1550_write_buffer {
+	int dir;		//root slot of the file
+	int file;		//slot of the file in its directory
+	struct cs1550_write_buffer* next;	//next buffer under the same file lock
+	off_t start;	//where in the file data[0] goes
+	size_t len;		//how many bytes of data are waiting
+	char data[WRITE_BUFFER_SIZE];
+};
+
+// How much memory the write buffers are using right now
+static long write_buffer_bytes = 0;
+
+// A file that is open. Every handle on the file shares one. Unlinking
+// an open file only takes its name away and marks it removed: the slot
+// and the blocks stay the file's, so its handles keep reading and
+// writing it, until the last handle is released and they go to the
+// reclaimer. Each gets a generation number of its own, so a readahead
+// queued for one is never mistaken for one of the next file in the
+// same slot. Truncating the file gives it a new one, since the blocks
+// its handles' cursors and queued readaheads know about may be gone.
+struct cs1550_open_file {
+	int dir;			//root slot of the file
+	int file;			//slot of the file in its directory
+	unsigned long gen;	//never the same for two open files, or across a truncate
+	int nHandles;		//handles using it
+	int removed;		//the file was unlinked, so the last release frees it
+	struct cs1550_open_file* next;	//next open file under the same file lock
+};
+
+// The last generation number handed out
+static unsigned long open_file_gen = 0;
+
+// How many locks the files share. Files hash to one of them, so this
+// only needs to be big enough that two busy files rarely collide.
+#define FILE_LOCKS 1024
+
+// A directory as the operations see it, or the root. The blocks it's
+// made of are listed in chain order, so finding a slot is an index into
+// that list. Slots below high are either in use or on the free stack,
+// and every slot from high on is empty, so mknod and mkdir never search
+// for room. All of it changes only with the directory's lock (or the
+// root's) held for writing, but a handle finds its file through blocks
+// without that lock, so a list that gets outgrown is kept until unmount
+// rather than freed. The entry just before blocks[0] points at the list
+// it replaced.
+struct cs1550_dir {
+	long* blocks;	//where each block of the directory is on disk
+	long nBlocks;	//how many blocks, 0 if the root slot is empty
+	long cap;		//how many blocks there's room for in blocks
+	long high;		//first slot past the last one that was ever used
+	int* free;		//empty slots below high, the last one is used next
+	long nFree;
+	long free_cap;
+	long nUsed;		//how many slots hold a file, or a directory in the root
+};
+
+// The directories are kept in chunks of this many root slots, which
+// are only made once a slot in them gets used
+#define DIR_CHUNK 1024
+
+// How many locks the directories share, the same way files share
+// the file locks
+#define DIR_LOCKS 1024
+
+// Metadata cache. The root, the allocation table and every directory
+// block are looked up once at mount and then used in place by the
+// operations. Blocks that get changed are remembered so that a flush
+// only writes back what is actually dirty instead of the whole image.
+struct cs1550_meta_cache {
+	cs1550_superblock* super;		//block 0, or NULL on an original image
+	cs1550_root_directory* root;	//the root directory
+	long root_block;				//where the root directory is
+	cs1550_bitmap* bitmap;			//the short table at block 1 of an original image
+	int* table;						//the 32-bit table described by the superblock
+	long nEntries;					//how many blocks the table covers
+	long table_start;				//first block of the table
+	long alloc_start;				//first block we're allowed to hand out
+	int extents;					//files use extent blocks instead of chains
+	int dir_chains;					//directories and the root can be more than one block
+	struct cs1550_dir root_slots;	//the root's blocks and slots
+	struct cs1550_dir** dirs;		//chunks of DIR_CHUNK directories, by root slot
+	long nDirChunks;				//how many chunks there's room for
+
+	unsigned char* dirty;	//one bit per block on the disk
+	struct cs1550_dirty {
+		long block;
+		int source;			//what dirtied it first, which its write back is charged to
+	} *dirty_list;			//blocks with their dirty bit set
+	long nDirty;			//how many blocks are in dirty_list
+	long dirty_cap;			//how much room dirty_list has
+	pthread_mutex_t dirty_lock;	//held while touching any of the dirty fields
+
+	// fuse runs the operations on many threads at once. The root and
+	// each directory block get a reader/writer lock so lookups only
+	// wait on a change to the same block, and each file hashes to one
+	// of the file locks for its data so I/O on different files runs in
+	// parallel. A file lock also looks after the write buffers of the
+	// files that hash to it.
+	pthread_rwlock_t root_lock;
+	pthread_rwlock_t dir_locks[DIR_LOCKS];
+	struct cs1550_file_lock {
+		pthread_rwlock_t lock;
+		struct cs1550_write_buffer* wbufs;	//buffers of the files using this lock
+		struct cs1550_open_file* open;		//files using this lock that are open
+	} file_locks[FILE_LOCKS];
+};
+
+static struct cs1550_meta_cache cache;
+
+// Get the lock for the directory in a root slot
+static pthread_rwlock_t* dir_lock(int dir) {
+	return &cache.dir_locks[(unsigned long) dir % DIR_LOCKS];
+}
+
+// Get the lock for the data of a file
+static struct cs1550_file_lock* file_lock(int dir, int file) {
+	return &cache.file_locks[((unsigned long) dir * MAX_FILES_IN_DIR + file) % FILE_LOCKS];
+}
+
+// Check whether a block holds nothing but zeroes
+static int block_is_zero(long block) {
+	const char* b = disk_block(block);
+	int i = 0;
+	for(i = 0; b != NULL && i < BLOCK_SIZE; i++) {
+		if(b[i] != 0) {
+			return 0;
+		}
+	}
+	return b != NULL;
+}
+
+// Lay out a superblock, an empty root and an allocation table
+// sized for the whole image. If the table is known to be all zeroes
+// already (a freshly made sparse image) clear can be 0, so only the
+// entries for the blocks we keep for ourselves get written.
+static int format_disk(int clear) {
+	// One 32-bit entry for every block it can cover, rounded
+	// up to whole blocks
+	long nEntries = disk.nBlocks < MAX_TABLE_ENTRIES ? disk.nBlocks : MAX_TABLE_ENTRIES;
+	long table_blocks = (nEntries * sizeof(int) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long data_start = 2 + table_blocks;
+	if(data_start >= nEntries) {
+		return -ENOSPC;
+	}
+
+	cs1550_superblock* super = disk_block(0);
+	memset(super, 0, BLOCK_SIZE);
+	super->magic = CS1550_MAGIC;
+	super->version = CS1550_VERSION;
+	super->nBlockSize = BLOCK_SIZE;
+	super->nEntrySize = sizeof(int);
+	super->nBlocks = nEntries;
+	super->nRootBlock = 1;
+	super->nTableStart = 2;
+	super->nTableBlocks = table_blocks;
+	super->nDataStart = data_start;
+	super->nFeatures = CS1550_FEATURE_EXTENTS | CS1550_FEATURE_DIR_CHAINS;
+	super->nFilesInDir = MAX_FILES_IN_DIR;
+	super->nDirsInRoot = MAX_DIRS_IN_ROOT;
+
+	// Start with an empty root
+	memset(disk_block(1), 0, BLOCK_SIZE);
+
+	// Clear the table, then mark the blocks we just used
+	// for ourselves as taken so they never get handed out
+	int* table = disk_block(2);
+	if(clear) {
+		memset(table, 0, table_blocks * BLOCK_SIZE);
+	}
+	long i = 0;
+	for(i = 0; i < data_start; i++) {
+		table[i] = EOF;
+	}
+	return 0;
+}
+
+// Look up the root, the allocation table and all of the directories
+// in the mapped image so the operations never have to
+static int cache_load() {
+	memset(&cache, 0, sizeof(cache));
+
+	// Set up the locks first so they're usable even if the mount fails
+	pthread_mutex_init(&cache.dirty_lock, NULL);
+	pthread_rwlock_init(&cache.root_lock, NULL);
+	int i = 0;
+	for(i = 0; i < FILE_LOCKS; i++) {
+		pthread_rwlock_init(&cache.file_locks[i].lock, NULL);
+	}
+	for(i = 0; i < DIR_LOCKS; i++) {
+		pthread_rwlock_init(&cache.dir_locks[i], NULL);
+	}
+
+	if(disk.map == NULL) {
+		return -EIO;
+	}
+
+	// Until we know better, blocks are the smallest size
+	disk_set_geometry(MIN_BLOCK_SIZE, 0, 0);
+
+	// A blank image gets a table sized to fit it, in blocks of the size
+	// we were asked for. This is also what an original image looks like
+	// before its first mkdir.
+	if(block_is_zero(0) && block_is_zero(1)) {
+		long size = options.block_size;
+		if(size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0 ||
+				disk.size < (size_t) size * 4) {
+			return -EINVAL;
+		}
+		disk_set_geometry(size, 0, 0);
+		int res = format_disk(1);
+		if(res < 0) {
+			return res;
+		}
+	}
+
+	cs1550_superblock* super = disk_block(0);
+	if(super->magic == CS1550_MAGIC) {
+		// Make sure we understand the layout before using any of it
+		long size = super->nBlockSize;
+		if(size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0) {
+			return -EINVAL;
+		}
+		disk_set_geometry(size, super->nFilesInDir, super->nDirsInRoot);
+		if(super->version != CS1550_VERSION || super->nEntrySize != sizeof(int) ||
+				MAX_FILES_IN_DIR > (long) FILES_IN_BLOCK(size) || MAX_DIRS_IN_ROOT > (long) DIRS_IN_BLOCK(size) ||
+				super->nBlocks > disk.nBlocks || super->nBlocks > MAX_TABLE_ENTRIES ||
+				super->nTableStart + super->nTableBlocks > super->nBlocks ||
+				super->nTableBlocks * BLOCK_SIZE < super->nBlocks * (long) sizeof(int)) {
+			return -EINVAL;
+		}
+		cache.super = super;
+		cache.root_block = super->nRootBlock;
+		cache.table = disk_block(super->nTableStart);
+		cache.table_start = super->nTableStart;
+		cache.nEntries = super->nBlocks;
+		cache.alloc_start = super->nDataStart;
+		cache.extents = (super->nFeatures & CS1550_FEATURE_EXTENTS) != 0;
+		cache.dir_chains = 1;
+	} else {
+		// The original layout, which only has room in its
+		// table for the first MAX_MAP_ENTRIES blocks
+		cache.root_block = 0;
+		cache.bitmap = disk_block(1);
+		cache.table_start = 1;
+		cache.nEntries = disk.nBlocks < (long) MAX_MAP_ENTRIES ? disk.nBlocks : (long) MAX_MAP_ENTRIES;
+		cache.alloc_start = START_ALLOC_INDEX;
+	}
+
+	cache.root = disk_block(cache.root_block);
+	if(cache.root == NULL || (cache.table == NULL && cache.bitmap == NULL)) {
+		return -EIO;
+	}
+
+	// Now we know how many directories there can be. A root that can
+	// grow never holds more of them than the disk has blocks.
+	long slots = cache.dir_chains ? cache.nEntries : MAX_DIRS_IN_ROOT;
+	if(slots > INT_MAX) {
+		slots = INT_MAX;
+	}
+	cache.nDirChunks = (slots + DIR_CHUNK - 1) / DIR_CHUNK;
+	cache.dirs = calloc(cache.nDirChunks, sizeof(struct cs1550_dir*));
+	if(cache.dirs == NULL) {
+		return -ENOMEM;
+	}
+
+	// Start out with nothing dirty
+	cache.dirty = calloc((disk.nBlocks + 7) / 8, 1);
+	if(cache.dirty == NULL) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+// Add a block to the dirty list, with dirty_lock held
+static void dirty_add(long block) {
+	if(cache.dirty == NULL || block < 0 || block >= disk.nBlocks) {
+		return;
+	}
+	// Nothing to do if we already know about it
+	if(cache.dirty[block / 8] & (1 << (block % 8))) {
+		return;
+	}
+	// Make room on the list if we need to
+	if(cache.nDirty == cache.dirty_cap) {
+		long cap = cache.dirty_cap ? cache.dirty_cap * 2 : 64;
+		struct cs1550_dirty* list = realloc(cache.dirty_list, cap * sizeof(struct cs1550_dirty));
+		if(list == NULL) {
+			//can't track it, so the next write back syncs everything
+			cache.nDirty = -1;
+			return;
+		}
+		cache.dirty_list = list;
+		cache.dirty_cap = cap;
+	}
+	if(cache.nDirty < 0) {
+		return;
+	}
+	cache.dirty[block / 8] |= 1 << (block % 8);
+	cache.dirty_list[cache.nDirty].block = block;
+	cache.dirty_list[cache.nDirty].source = io_source;
+	cache.nDirty++;
+}
+
+// Remember that a block has been changed and needs writing back
+static void cache_mark_dirty(long block) {
+	pthread_mutex_lock(&cache.dirty_lock);
+	dirty_add(block);
+	pthread_mutex_unlock(&cache.dirty_lock);
+}
+
+// Used to sort the dirty list so neighbouring blocks go out together
+static int compare_blocks(const void* a, const void* b) {
+	long x = ((const struct cs1550_dirty*) a)->block;
+	long y = ((const struct cs1550_dirty*) b)->block;
+	return (x > y) - (x < y);
+}
+
+// Write every dirty block back to .disk, with dirty_lock held
+static int dirty_writeback() {
+	int res = 0;
+	if(disk.map == NULL || cache.nDirty == 0) {
+		return 0;
+	}
+	// If we lost track of what's dirty, sync the whole thing
+	if(cache.nDirty < 0) {
+		res = disk_sync();
+		if(cache.dirty != NULL) {
+			memset(cache.dirty, 0, (disk.nBlocks + 7) / 8);
+		}
+		cache.nDirty = 0;
+		return res;
+	}
+
+	// msync works on whole pages, so each run of dirty blocks
+	// gets rounded out to the pages that hold it
+	long page = sysconf(_SC_PAGESIZE);
+	qsort(cache.dirty_list, cache.nDirty, sizeof(struct cs1550_dirty), compare_blocks);
+
+	// Every run goes to the backend in one batch. What it writes is
+	// charged to whatever dirtied its blocks, not to whoever happens
+	// to be writing them back, so each block's source gets an even
+	// share of its run and the first block's source gets the request.
+	struct cs1550_io_batch batch;
+	io_batch_init(&batch);
+	unsigned long written[IO_SOURCES] = { 0 };
+	unsigned long requests[IO_SOURCES] = { 0 };
+	long i = 0;
+	while(i < cache.nDirty) {
+		long first = i;
+		long block = cache.dirty_list[i].block;
+		size_t start = (block * BLOCK_SIZE) & ~(page - 1);
+		size_t end = (block + 1) * BLOCK_SIZE;
+		cache.dirty[block / 8] &= ~(1 << (block % 8));
+		i++;
+
+		// Pull in every following block that lands in this run
+		while(i < cache.nDirty && (size_t) (cache.dirty_list[i].block * BLOCK_SIZE) <= ((end + page - 1) & ~(page - 1))) {
+			block = cache.dirty_list[i].block;
+			end = (block + 1) * BLOCK_SIZE;
+			cache.dirty[block / 8] &= ~(1 << (block % 8));
+			i++;
+		}
+
+		long k = 0;
+		for(k = first; k < i; k++) {
+			written[cache.dirty_list[k].source] += (end - start) / (i - first);
+		}
+		written[cache.dirty_list[first].source] += (end - start) % (i - first);
+
+		int nIos = batch.nIos;
+		if(io_batch_add(&batch, IO_SYNC, NULL, end - start, start) < 0) {
+			//no room to batch it, so sync it right now
+			struct cs1550_io io = { IO_SYNC, NULL, end - start, start };
+			requests[cache.dirty_list[first].source]++;
+			int r = io_do(&io);
+			if(r < 0) {
+				res = r;
+			}
+		} else {
+			requests[cache.dirty_list[first].source] += batch.nIos - nIos;
+		}
+	}
+	for(i = 0; i < IO_SOURCES; i++) {
+		if(written[i] > 0 || requests[i] > 0) {
+			io_charge(i, 0, written[i], requests[i]);
+		}
+	}
+	int bres = batch.nIos > 0 ? io_backend->submit(batch.ios, batch.nIos) : 0;
+	io_batch_free(&batch);
+	cache.nDirty = 0;
+	return res < 0 ? res : bres;
+}
+
+// Write every dirty block back to .disk and forget about them
+static int cache_writeback() {
+	pthread_mutex_lock(&cache.dirty_lock);
+	int res = dirty_writeback();
+	pthread_mutex_unlock(&cache.dirty_lock);
+	return res;
+}
+
+// Free the lists a directory keeps, and every list it outgrew
+static void dir_free(struct cs1550_dir* d) {
+	long* old = d->blocks != NULL ? d->blocks - 1 : NULL;
+	while(old != NULL) {
+		long* next = (long*) (intptr_t) old[0];
+		free(old);
+		old = next;
+	}
+	free(d->free);
+	memset(d, 0, sizeof(struct cs1550_dir));
+}
+
+// Throw away everything the cache holds at unmount
+static void cache_drop() {
+	long i = 0;
+	for(i = 0; i < DIR_LOCKS; i++) {
+		pthread_rwlock_destroy(&cache.dir_locks[i]);
+	}
+	for(i = 0; cache.dirs != NULL && i < cache.nDirChunks * DIR_CHUNK; i++) {
+		if(cache.dirs[i / DIR_CHUNK] != NULL) {
+			dir_free(&cache.dirs[i / DIR_CHUNK][i % DIR_CHUNK]);
+		}
+	}
+	for(i = 0; cache.dirs != NULL && i < cache.nDirChunks; i++) {
+		free(cache.dirs[i]);
+	}
+	for(i = 0; i < FILE_LOCKS; i++) {
+		pthread_rwlock_destroy(&cache.file_locks[i].lock);
+	}
+	dir_free(&cache.root_slots);
+	free(cache.dirs);
+	pthread_rwlock_destroy(&cache.root_lock);
+	pthread_mutex_destroy(&cache.dirty_lock);
+	free(cache.dirty);
+	free(cache.dirty_list);
+	memset(&cache, 0, sizeof(cache));
+}
+
+// Get the root directory
+static cs1550_root_directory* get_root_dir() {
+	return cache.root;
+}
+
+// Get the allocation table entry for a block: 0 if the block is free,
+// EOF if it ends a chain, or else the next block in the chain
+static long table_get(long block) {
+	if(block < 0 || block >= cache.nEntries) {
+		return EOF;
+	}
+	if(cache.table != NULL) {
+		return cache.table[block];
+	}
+	return cache.bitmap->table[block];
+}
+
+// Set the allocation table entry for a block
+static void table_set(long block, long value) {
+	if(block < 0 || block >= cache.nEntries) {
+		return;
+	}
+	if(cache.table != NULL) {
+		cache.table[block] = value;
+		cache_mark_dirty(cache.table_start + (block * sizeof(int)) / BLOCK_SIZE);
+	} else {
+		cache.bitmap->table[block] = value;
+		cache_mark_dirty(cache.table_start);
+	}
+}
+
+// Free-space bitmap that sits in front of the allocation table so that
+// finding a free block doesn't mean scanning the table. A set bit in
+// free means the block is free. Each bit of summary covers one word of
+// free and is set while that word still has a free block in it, so one
+// summary word stands in for 4096 blocks when searching.
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+struct cs1550_allocator {
+	unsigned long* free;	//one bit per block, set when the block is free
+	unsigned long* summary;	//one bit per word of free, set when that word has a free bit
+	long nWords;			//how many words are in free
+	long nFree;				//how many blocks are free right now
+	long cursor;			//where the last allocation was, next-fit starts from here
+	pthread_mutex_t lock;	//held while searching or changing any of the above
+};
+
+static struct cs1550_allocator allocator;
+
+// Record that a block is free in the bitmap
+static void alloc_mark_free(long block) {
+	long w = block / BITS_PER_WORD;
+	if(!(allocator.free[w] & (1UL << (block % BITS_PER_WORD)))) {
+		allocator.free[w] |= 1UL << (block % BITS_PER_WORD);
+		allocator.summary[w / BITS_PER_WORD] |= 1UL << (w % BITS_PER_WORD);
+		allocator.nFree++;
+	}
+}
+
+// Record that a block is in use in the bitmap
+static void alloc_mark_used(long block) {
+	long w = block / BITS_PER_WORD;
+	if(allocator.free[w] & (1UL << (block % BITS_PER_WORD))) {
+		allocator.free[w] &= ~(1UL << (block % BITS_PER_WORD));
+		allocator.nFree--;
+		// Clear the summary bit once the word fills up
+		if(allocator.free[w] == 0) {
+			allocator.summary[w / BITS_PER_WORD] &= ~(1UL << (w % BITS_PER_WORD));
+		}
+	}
+}
+
+// Build the bitmap from the allocation table. Called once at mount.
+static int alloc_init() {
+	pthread_mutex_init(&allocator.lock, NULL);
+	allocator.nWords = (cache.nEntries + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	allocator.free = calloc(allocator.nWords, sizeof(unsigned long));
+	allocator.summary = calloc((allocator.nWords + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+	allocator.nFree = 0;
+	allocator.cursor = cache.alloc_start;
+	if(allocator.free == NULL || allocator.summary == NULL) {
+		return -ENOMEM;
+	}
+
+	long k = 0;
+	for(k = cache.alloc_start; k < cache.nEntries; k++) {
+		if(table_get(k) == 0) {
+			alloc_mark_free(k);
+		}
+	}
+	return 0;
+}
+
+// Throw the bitmap away at unmount
+static void alloc_drop() {
+	pthread_mutex_destroy(&allocator.lock);
+	free(allocator.free);
+	free(allocator.summary);
+	memset(&allocator, 0, sizeof(allocator));
+}
+
+// Find the first free block at or after start, or -1 if there isn't one
+static long alloc_search(long start) {
+	if(start >= cache.nEntries) {
+		return -1;
+	}
+
+	// Look at what's left of the word start is in
+	long w = start / BITS_PER_WORD;
+	unsigned long bits = allocator.free[w] & (~0UL << (start % BITS_PER_WORD));
+	if(bits != 0) {
+		return w * BITS_PER_WORD + __builtin_ctzl(bits);
+	}
+
+	// Then let the summary find the next word with anything free
+	long sw = (w + 1) / BITS_PER_WORD;
+	long nSummary = (allocator.nWords + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	if(w + 1 >= allocator.nWords) {
+		return -1;
+	}
+	unsigned long sbits = allocator.summary[sw] & (~0UL << ((w + 1) % BITS_PER_WORD));
+	while(sbits == 0) {
+		if(++sw >= nSummary) {
+			return -1;
+		}
+		sbits = allocator.summary[sw];
+	}
+	w = sw * BITS_PER_WORD + __builtin_ctzl(sbits);
+	return w * BITS_PER_WORD + __builtin_ctzl(allocator.free[w]);
+}
+
+// Reclaiming. unlink and rmdir only take the name away and queue the
+// blocks it had for the reclaimer thread, which walks them and gives
+// them back to the allocator a batch at a time. Removing a huge file
+// costs the caller no more than removing an empty one. The blocks stay
+// in use until the reclaimer gets to them, so anything that finds the
+// disk full waits for it to catch up before giving up.
+#define RECLAIM_BATCH 1024
+
+// Something waiting to be freed
+struct cs1550_reclaim_item {
+	long block;		//the file's start block, or a directory's block
+	long length;	//if not 0, free this many blocks from block on instead of a chain
+	int extents;	//block is an extent block whose runs go too
+};
+
+struct cs1550_reclaimer {
+	struct cs1550_reclaim_item* queue;
+	long nQueued;
+	long cap;
+	int busy;				//the thread is freeing what it took off the queue
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	//something was queued, or it's time to stop
+	pthread_cond_t idle;	//the queue emptied out
+	int running;
+	int started;
+	unsigned long freed;	//blocks given back since mount
+};
+
+static struct cs1550_reclaimer reclaimer;
+
+// Give a batch of blocks back, taking the allocator's lock only once
+static void reclaim_free(long* blocks, int n) {
+	int i = 0;
+	pthread_mutex_lock(&allocator.lock);
+	for(i = 0; i < n; i++) {
+		if(blocks[i] >= cache.alloc_start && blocks[i] < cache.nEntries) {
+			table_set(blocks[i], 0);
+			alloc_mark_free(blocks[i]);
+		}
+	}
+	pthread_mutex_unlock(&allocator.lock);
+	for(i = 0; i < n; i++) {
+		bcache_forget(blocks[i]);
+	}
+	__atomic_add_fetch(&reclaimer.freed, n, __ATOMIC_RELAXED);
+}
+
+// Add a block to the batch, freeing the batch once it fills up
+static void reclaim_add(long* batch, int* n, long block) {
+	batch[(*n)++] = block;
+	if(*n == RECLAIM_BATCH) {
+		reclaim_free(batch, *n);
+		*n = 0;
+	}
+}
+
+// Free every block of the items. Nothing else can reach them any more,
+// so the chains can be walked without any locks. A walk never takes
+// more steps than the disk has blocks, in case a chain loops.
+static void reclaim_items(struct cs1550_reclaim_item* items, long nItems) {
+	long batch[RECLAIM_BATCH];
+	int n = 0;
+	long i = 0;
+	for(i = 0; i < nItems; i++) {
+		long block = items[i].block;
+		long steps = 0;
+
+		// A run that was cut off the end of a file
+		if(items[i].length > 0) {
+			for(steps = 0; steps < items[i].length; steps++) {
+				reclaim_add(batch, &n, block + steps);
+			}
+			continue;
+		}
+		while(block >= cache.alloc_start && block < cache.nEntries && steps++ < cache.nEntries) {
+			// Every run an extent block points at goes with it
+			cs1550_extent_block* eb = items[i].extents ? disk_block(block) : NULL;
+			int e = 0;
+			for(e = 0; eb != NULL && e < eb->nExtents && e < (int) MAX_EXTENTS_IN_BLOCK; e++) {
+				long k = 0;
+				for(k = 0; k < eb->extents[e].nLength; k++) {
+					reclaim_add(batch, &n, eb->extents[e].nStartBlock + k);
+				}
+			}
+
+			// Find the next block before this one is given back
+			long next = table_get(block);
+			reclaim_add(batch, &n, block);
+			block = next;
+		}
+	}
+	if(n > 0) {
+		reclaim_free(batch, n);
+	}
+}
+
+// The reclaimer thread. Takes everything queued at once and frees it,
+// and doesn't stop until the queue is empty.
+static void* reclaim_thread(void* arg) {
+	(void) arg;
+	pthread_mutex_lock(&reclaimer.lock);
+	while(reclaimer.running || reclaimer.nQueued > 0) {
+		if(reclaimer.nQueued == 0) {
+			pthread_cond_wait(&reclaimer.wake, &reclaimer.lock);
+			continue;
+		}
+		struct cs1550_reclaim_item* items = reclaimer.queue;
+		long nItems = reclaimer.nQueued;
+		reclaimer.queue = NULL;
+		reclaimer.nQueued = 0;
+		reclaimer.cap = 0;
+		reclaimer.busy = 1;
+		pthread_mutex_unlock(&reclaimer.lock);
+
+		reclaim_items(items, nItems);
+		free(items);
+
+		pthread_mutex_lock(&reclaimer.lock);
+		reclaimer.busy = 0;
+		pthread_cond_broadcast(&reclaimer.idle);
+	}
+	pthread_mutex_unlock(&reclaimer.lock);
+	return NULL;
+}
+
+static void reclaim_start() {
+	memset(&reclaimer, 0, sizeof(reclaimer));
+	pthread_mutex_init(&reclaimer.lock, NULL);
+	pthread_cond_init(&reclaimer.wake, NULL);
+	pthread_cond_init(&reclaimer.idle, NULL);
+	reclaimer.running = 1;
+	if(pthread_create(&reclaimer.thread, NULL, reclaim_thread, NULL) == 0) {
+		reclaimer.started = 1;
+	} else {
+		reclaimer.running = 0;
+	}
+}
+
+// Free everything still queued and stop the thread
+static void reclaim_stop() {
+	pthread_mutex_lock(&reclaimer.lock);
+	reclaimer.running = 0;
+	pthread_cond_signal(&reclaimer.wake);
+	pthread_mutex_unlock(&reclaimer.lock);
+	if(reclaimer.started) {
+		pthread_join(reclaimer.thread, NULL);
+	}
+	pthread_cond_destroy(&reclaimer.idle);
+	pthread_cond_destroy(&reclaimer.wake);
+	pthread_mutex_destroy(&reclaimer.lock);
+	free(reclaimer.queue);
+	memset(&reclaimer, 0, sizeof(reclaimer));
+}
+
+// Hand something to the reclaimer. If there's no thread, or no room to
+// queue it, it's freed right here instead.
+static void reclaim_push(struct cs1550_reclaim_item item) {
+	pthread_mutex_lock(&reclaimer.lock);
+	if(reclaimer.started && reclaimer.nQueued == reclaimer.cap) {
+		long cap = reclaimer.cap ? reclaimer.cap * 2 : 64;
+		struct cs1550_reclaim_item* queue = realloc(reclaimer.queue, cap * sizeof(struct cs1550_reclaim_item));
+		if(queue != NULL) {
+			reclaimer.queue = queue;
+			reclaimer.cap = cap;
+		}
+	}
+	if(reclaimer.started && reclaimer.nQueued < reclaimer.cap) {
+		reclaimer.queue[reclaimer.nQueued++] = item;
+		pthread_cond_signal(&reclaimer.wake);
+		pthread_mutex_unlock(&reclaimer.lock);
+		return;
+	}
+	pthread_mutex_unlock(&reclaimer.lock);
+	reclaim_items(&item, 1);
+}
+
+// Hand the blocks of the chain starting at block to the reclaimer
+static void reclaim_queue(long block, int extents) {
+	struct cs1550_reclaim_item item = { block, 0, extents };
+	reclaim_push(item);
+}
+
+// Hand length blocks in a row starting at block to the reclaimer
+static void reclaim_queue_run(long block, long length) {
+	struct cs1550_reclaim_item item = { block, length, 0 };
+	reclaim_push(item);
+}
+
+// Wait for everything queued so far to be freed. Returns 0 if there
+// was nothing to wait for.
+static int reclaim_wait() {
+	int waited = 0;
+	pthread_mutex_lock(&reclaimer.lock);
+	while(reclaimer.started && (reclaimer.nQueued > 0 || reclaimer.busy)) {
+		waited = 1;
+		pthread_cond_wait(&reclaimer.idle, &reclaimer.lock);
+	}
+	pthread_mutex_unlock(&reclaimer.lock);
+	return waited;
+}
+
+// Find a free block as close after hint as we can, mark it as the end of
+// a chain and hand it back. Passing the block after a file's last block
+// keeps the file in one contiguous run whenever that block is free.
+// Returns -1 once the disk is full.
+static long alloc_block_near(long hint) {
+	if(allocator.free == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&allocator.lock);
+
+	// Try right where we were asked first, then fall back to next-fit:
+	// carry on from the last allocation and only wrap back to the
+	// start of the disk if there's nothing after it
+	long k = -1;
+	if(allocator.nFree > 0) {
+		if(hint >= cache.alloc_start && hint < cache.nEntries &&
+				(allocator.free[hint / BITS_PER_WORD] & (1UL << (hint % BITS_PER_WORD)))) {
+			k = hint;
+		}
+		if(k < 0) {
+			k = alloc_search(allocator.cursor);
+		}
+		if(k < 0) {
+			k = alloc_search(cache.alloc_start);
+		}
+	}
+
+	if(k >= 0) {
+		alloc_mark_used(k);
+		table_set(k, EOF);
+		allocator.cursor = k + 1;
+	}
+	pthread_mutex_unlock(&allocator.lock);
+
+	// The disk might only look full because of blocks on their way back
+	if(k < 0 && reclaim_wait()) {
+		return alloc_block_near(hint);
+	}
+	return k;
+}
+
+// Find a free block anywhere, see alloc_block_near
+static long alloc_block() {
+	return alloc_block_near(-1);
+}
+
+// Give a block back so it can be handed out again
+static void free_block(long block) {
+	if(block < cache.alloc_start || block >= cache.nEntries) {
+		return;
+	}
+	pthread_mutex_lock(&allocator.lock);
+	table_set(block, 0);
+	alloc_mark_free(block);
+	pthread_mutex_unlock(&allocator.lock);
+	bcache_forget(block);
+}
+
+// Where we last were in a file. Blocks n up to run_end - 1 of the file
+// are known to sit one after another on disk starting at block, so
+// moving forward inside that run doesn't need any lookups at all.
+// A cursor that belongs to an open file can also keep a map of every
+// chain block it has walked past, so it never has to walk them again.
+struct cs1550_file_cursor {
+	long n;			//block of the file the run starts at, -1 if we're nowhere yet
+	long block;		//where block n of the file is on disk
+	long run_end;	//first block of the file past the run
+
+	long* map;		//map[i] is where block i of a chain file is, NULL if not kept
+	long nMapped;	//how many entries of map are filled in
+	long map_cap;	//how much room map has
+};
+
+// Set a cursor up so that it doesn't point anywhere
+static void cursor_reset(struct cs1550_file_cursor* cur) {
+	cur->n = -1;
+	cur->block = -1;
+	cur->run_end = -1;
+	cur->map = NULL;
+	cur->nMapped = 0;
+	cur->map_cap = 0;
+}
+
+// Forget where a cursor is and the blocks it mapped, keeping the room
+// it has for a map
+static void cursor_forget(struct cs1550_file_cursor* cur) {
+	cur->n = -1;
+	cur->block = -1;
+	cur->run_end = -1;
+	cur->nMapped = 0;
+}
+
+// Add block n of a chain file to the cursor's map, if it keeps one and
+// n is the next block it doesn't know about yet
+static void cursor_remember(struct cs1550_file_cursor* cur, long n, long block) {
+	if(cur->map == NULL || n != cur->nMapped) {
+		return;
+	}
+	if(cur->nMapped == cur->map_cap) {
+		long cap = cur->map_cap * 2;
+		long* map = realloc(cur->map, cap * sizeof(long));
+		if(map == NULL) {
+			//stop growing it, we can always walk from the end
+			return;
+		}
+		cur->map = map;
+		cur->map_cap = cap;
+	}
+	cur->map[cur->nMapped++] = block;
+}
+
+// Find the extent holding block n of a file by walking its extent blocks
+// and then doing a binary search in the one that has it. Returns 0 and
+// fills in ext, or -1 if the file doesn't have that many blocks.
+static int extent_find(long map, long n, struct cs1550_extent* ext) {
+	while(map != EOF) {
+		cs1550_extent_block* eb = disk_block(map);
+		if(eb == NULL || eb->nExtents <= 0) {
+			return -1;
+		}
+
+		// Skip this extent block if n is past its last extent
+		struct cs1550_extent* last = &eb->extents[eb->nExtents - 1];
+		if(n < last->nFileBlock + last->nLength) {
+			int lo = 0;
+			int hi = eb->nExtents - 1;
+			while(lo < hi) {
+				int mid = (lo + hi + 1) / 2;
+				if(eb->extents[mid].nFileBlock <= n) {
+					lo = mid;
+				} else {
+					hi = mid - 1;
+				}
+			}
+			if(n < eb->extents[lo].nFileBlock) {
+				return -1;
+			}
+			*ext = eb->extents[lo];
+			return 0;
+		}
+		map = table_get(map);
+	}
+	return -1;
+}
+
+// Find where block n of a file is on disk, or -1 if the file doesn't
+// have that many blocks yet. cur remembers where the last lookup ended
+// so walking through a file in order only costs one step per block.
+static long file_block(const struct cs1550_file_directory* file, long n, struct cs1550_file_cursor* cur) {
+	// Inside the run we already know about
+	if(cur->n >= 0 && n >= cur->n && n < cur->run_end) {
+		return cur->block + (n - cur->n);
+	}
+
+	if(cache.extents) {
+		// Look it up in the extent list
+		struct cs1550_extent ext;
+		if(extent_find(file->nStartBlock, n, &ext) < 0) {
+			return -1;
+		}
+		cur->n = ext.nFileBlock;
+		cur->block = ext.nStartBlock;
+		cur->run_end = ext.nFileBlock + ext.nLength;
+		return cur->block + (n - cur->n);
+	}
+
+	// Use the chain blocks we've mapped out already
+	if(n < cur->nMapped) {
+		cur->n = n;
+		cur->block = cur->map[n];
+		cur->run_end = n + 1;
+		return cur->block;
+	}
+
+	// Follow the chain, picking up from the furthest block we know
+	// about when that's behind where we want to be
+	long i = 0;
+	long block = file->nStartBlock;
+	if(cur->nMapped > 0) {
+		i = cur->nMapped - 1;
+		block = cur->map[i];
+	}
+	if(cur->n >= 0 && n >= cur->n && cur->n > i) {
+		i = cur->n;
+		block = cur->block;
+	}
+	if(i == 0) {
+		cursor_remember(cur, 0, block);
+	}
+	while(i < n && block != EOF) {
+		block = table_get(block);
+		i++;
+		if(block != EOF) {
+			cursor_remember(cur, i, block);
+		}
+	}
+	if(block == EOF || block < 0) {
+		return -1;
+	}
+	cur->n = n;
+	cur->block = block;
+	cur->run_end = n + 1;
+	return block;
+}
+
+// Add block n to the end of a file, where last is the file's current
+// last block on disk (or -1 if it has none). The new block goes right
+// after last whenever that one is free, so a file written in order ends
+// up as one run. Returns the new block, or -1 if the disk is full.
+static long file_extend(const struct cs1550_file_directory* file, long n, long last, struct cs1550_file_cursor* cur) {
+	long block = alloc_block_near(last < 0 ? -1 : last + 1);
+	if(block < 0) {
+		return -1;
+	}
+
+	if(!cache.extents) {
+		// Hook the new block onto the end of the chain,
+		// which always has at least the block from mknod
+		if(last < 0) {
+			free_block(block);
+			return -1;
+		}
+		table_set(last, block);
+		cursor_remember(cur, n, block);
+	} else {
+		// Find the last extent block
+		long map = file->nStartBlock;
+		while(table_get(map) != EOF) {
+			map = table_get(map);
+		}
+		cs1550_extent_block* eb = disk_block(map);
+		if(eb == NULL) {
+			free_block(block);
+			return -1;
+		}
+
+		struct cs1550_extent* ext = eb->nExtents > 0 ? &eb->extents[eb->nExtents - 1] : NULL;
+		if(ext != NULL && ext->nStartBlock + ext->nLength == block) {
+			// It landed right after the last run, so just grow it
+			ext->nLength++;
+		} else {
+			// Start a new run, in a new extent block if this one is full
+			if(eb->nExtents == (int) MAX_EXTENTS_IN_BLOCK) {
+				long next = alloc_block();
+				cs1550_extent_block* neb = disk_block(next);
+				if(neb == NULL) {
+					free_block(block);
+					return -1;
+				}
+				memset(neb, 0, BLOCK_SIZE);
+				table_set(map, next);
+				map = next;
+				eb = neb;
+			}
+			ext = &eb->extents[eb->nExtents++];
+			ext->nFileBlock = n;
+			ext->nStartBlock = block;
+			ext->nLength = 1;
+		}
+		cache_mark_dirty(map);
+	}
+
+	// The cursor now sits on the new block
+	cur->n = n;
+	cur->block = block;
+	cur->run_end = n + 1;
+	return block;
+}
+
+// Cut a file down to its first keep blocks and hand the rest to the
+// reclaimer. A chain always keeps the block from mknod, and the first
+// extent block stays even with no extents left in it. The caller holds
+// the file's lock for writing.
+static void file_cut(const struct cs1550_file_directory* file, long keep) {
+	if(!cache.extents) {
+		struct cs1550_file_cursor cur;
+		cursor_reset(&cur);
+		long last = file_block(file, keep > 0 ? keep - 1 : 0, &cur);
+		long next = last < 0 ? EOF : table_get(last);
+		if(next != EOF) {
+			table_set(last, EOF);
+			reclaim_queue(next, 0);
+		}
+		return;
+	}
+
+	// Find the first extent that reaches past keep
+	long prev = EOF;
+	long map = file->nStartBlock;
+	while(map != EOF) {
+		cs1550_extent_block* eb = disk_block(map);
+		if(eb == NULL) {
+			return;
+		}
+		int e = 0;
+		while(e < eb->nExtents && eb->extents[e].nFileBlock + eb->extents[e].nLength <= keep) {
+			e++;
+		}
+		if(e == eb->nExtents) {
+			prev = map;
+			map = table_get(map);
+			continue;
+		}
+
+		// Shorten the one the cut falls in, then drop the rest of
+		// this extent block's runs and every extent block after it
+		if(eb->extents[e].nFileBlock < keep) {
+			long length = keep - eb->extents[e].nFileBlock;
+			reclaim_queue_run(eb->extents[e].nStartBlock + length, eb->extents[e].nLength - length);
+			eb->extents[e].nLength = length;
+			e++;
+		}
+		int i = 0;
+		for(i = e; i < eb->nExtents; i++) {
+			reclaim_queue_run(eb->extents[i].nStartBlock, eb->extents[i].nLength);
+		}
+		eb->nExtents = e;
+		cache_mark_dirty(map);
+
+		long next = table_get(map);
+		if(e == 0 && prev != EOF) {
+			// Nothing left in this one, so it goes too
+			next = map;
+			map = prev;
+		}
+		if(next != EOF) {
+			table_set(map, EOF);
+			reclaim_queue(next, 1);
+		}
+		return;
+	}
+}
+
+// Get the place a root slot keeps its directory, or NULL if the slot
+// is past anything the root can hold. Unless create is set, NULL also
+// means no slot near it was ever used. Creating one happens with the
+// root's lock held for writing.
+static struct cs1550_dir* dir_state(long slot, int create) {
+	if(cache.dirs == NULL || slot < 0 || slot / DIR_CHUNK >= cache.nDirChunks) {
+		return NULL;
+	}
+	struct cs1550_dir* chunk = __atomic_load_n(&cache.dirs[slot / DIR_CHUNK], __ATOMIC_ACQUIRE);
+	if(chunk == NULL && create) {
+		chunk = calloc(DIR_CHUNK, sizeof(struct cs1550_dir));
+		__atomic_store_n(&cache.dirs[slot / DIR_CHUNK], chunk, __ATOMIC_RELEASE);
+	}
+	return chunk != NULL ? &chunk[slot % DIR_CHUNK] : NULL;
+}
+
+// Get the directory in the given root slot, or NULL if there isn't one
+static struct cs1550_dir* get_directory(int slot) {
+	struct cs1550_dir* d = dir_state(slot, 0);
+	if(d == NULL || __atomic_load_n(&d->nBlocks, __ATOMIC_ACQUIRE) == 0) {
+		return NULL;
+	}
+	return d;
+}
+
+// How many slots each block of a directory has. The root is laid out
+// the same way as the others, just with directories in its slots.
+static long dir_slots(struct cs1550_dir* d) {
+	return d == &cache.root_slots ? MAX_DIRS_IN_ROOT : MAX_FILES_IN_DIR;
+}
+
+// Get slot n of a directory, or NULL if the directory doesn't have that
+// many slots. A slot never moves, so the caller only needs the
+// directory's lock if the slot might not be there yet. Every kind of
+// slot starts with its name.
+static char* dir_slot(struct cs1550_dir* d, long n) {
+	if(d == NULL || n < 0 || n / dir_slots(d) >= __atomic_load_n(&d->nBlocks, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	long* blocks = __atomic_load_n(&d->blocks, __ATOMIC_ACQUIRE);
+	char* block = disk_block(blocks[n / dir_slots(d)]);
+	if(block == NULL) {
+		return NULL;
+	}
+	if(d == &cache.root_slots) {
+		return (char*) &((cs1550_root_directory*) block)->directories[n % MAX_DIRS_IN_ROOT];
+	}
+	return (char*) &((cs1550_directory_entry*) block)->files[n % MAX_FILES_IN_DIR];
+}
+
+// Get file slot n of a directory, see dir_slot
+static struct cs1550_file_directory* dir_file(struct cs1550_dir* d, long n) {
+	return (struct cs1550_file_directory*) dir_slot(d, n);
+}
+
+// Get slot n of the root, see dir_slot
+static struct cs1550_directory* root_slot(long n) {
+	return (struct cs1550_directory*) dir_slot(&cache.root_slots, n);
+}
+
+// Get the block that holds slot n of a directory
+static long dir_block(struct cs1550_dir* d, long n) {
+	return d->blocks[n / dir_slots(d)];
+}
+
+// Count slot n of a directory as taken (delta 1) or given up (-1),
+// both in memory and in the count at the front of the block holding it.
+// The nFiles of a directory block and the nDirectories of a root block
+// are the same int. The caller holds the directory's lock for writing.
+static void dir_count(struct cs1550_dir* d, long n, int delta) {
+	long block = dir_block(d, n);
+	d->nUsed += delta;
+	((cs1550_directory_entry*) disk_block(block))->nFiles += delta;
+	cache_mark_dirty(block);
+}
+
+// Make sure a directory has room to list nBlocks blocks. A bigger list
+// is filled in before anyone can see it, and the old one stays behind
+// it for whoever might still be reading it.
+static int dir_reserve(struct cs1550_dir* d, long nBlocks) {
+	if(nBlocks <= d->cap) {
+		return 0;
+	}
+	long cap = d->cap > 0 ? d->cap * 2 : 1;
+	while(cap < nBlocks) {
+		cap *= 2;
+	}
+	long* base = malloc((cap + 1) * sizeof(long));
+	if(base == NULL) {
+		return -ENOMEM;
+	}
+	base[0] = d->blocks != NULL ? (long) (intptr_t) (d->blocks - 1) : 0;
+	if(d->nBlocks > 0) {
+		memcpy(base + 1, d->blocks, d->nBlocks * sizeof(long));
+	}
+	__atomic_store_n(&d->blocks, base + 1, __ATOMIC_RELEASE);
+	d->cap = cap;
+	return 0;
+}
+
+// Put an empty slot on a directory's free stack. If there's no memory
+// for a bigger stack the slot just isn't used again until the next mount.
+static void dir_put_slot(struct cs1550_dir* d, long n) {
+	if(d->nFree == d->free_cap) {
+		long cap = d->free_cap ? d->free_cap * 2 : 16;
+		int* slots = realloc(d->free, cap * sizeof(int));
+		if(slots == NULL) {
+			return;
+		}
+		d->free = slots;
+		d->free_cap = cap;
+	}
+	d->free[d->nFree++] = n;
+}
+
+// Read the directory whose first block is start into an empty root
+// slot by following its chain. A chain never takes more steps than the
+// disk has blocks, in case it loops. The caller holds the directory's
+// lock for writing, or is the mount.
+static int dir_load(struct cs1550_dir* d, long start) {
+	d->nFree = 0;
+	d->nUsed = 0;
+	d->high = 0;
+
+	long block = start;
+	long steps = 0;
+	while(disk_block(block) != NULL && steps++ < cache.nEntries) {
+		if(dir_reserve(d, d->nBlocks + 1) < 0) {
+			return -ENOMEM;
+		}
+		d->blocks[d->nBlocks] = block;
+		__atomic_store_n(&d->nBlocks, d->nBlocks + 1, __ATOMIC_RELEASE);
+		// Without chains the table entry isn't ours to follow
+		block = cache.dir_chains && table_get(block) > 0 ? table_get(block) : EOF;
+	}
+	if(d->nBlocks == 0) {
+		return -EIO;
+	}
+
+	// Find the last slot in use, then stack the empty ones below
+	// it so the lowest gets used first
+	long n = 0;
+	for(n = d->nBlocks * dir_slots(d) - 1; n >= 0; n--) {
+		if(strcmp(dir_slot(d, n), "") != 0) {
+			d->nUsed++;
+			if(d->high == 0) {
+				d->high = n + 1;
+			}
+		} else if(d->high > 0) {
+			dir_put_slot(d, n);
+		}
+	}
+	return 0;
+}
+
+// Add an empty block to the end of a directory. The caller holds the
+// directory's lock for writing.
+static int dir_grow(struct cs1550_dir* d) {
+	// A slot has to fit in an int, and an original image
+	// has nowhere to say its directories are chains
+	if(!cache.dir_chains || (d->nBlocks + 1) * dir_slots(d) > INT_MAX) {
+		return -ENOSPC;
+	}
+	// Have room to list it before it goes in, so there's nothing to undo
+	if(dir_reserve(d, d->nBlocks + 1) < 0) {
+		return -ENOMEM;
+	}
+
+	long last = d->blocks[d->nBlocks - 1];
+	long block = alloc_block_near(last + 1);
+	if(block < 0) {
+		return -ENOSPC;
+	}
+	cs1550_directory_entry* entry = disk_block(block);
+	if(entry == NULL) {
+		free_block(block);
+		return -EIO;
+	}
+	memset(entry, 0, BLOCK_SIZE);
+	cache_mark_dirty(block);
+	table_set(last, block);
+
+	// The first directory to grow, or the root, upgrades the image
+	if(!(cache.super->nFeatures & CS1550_FEATURE_DIR_CHAINS)) {
+		cache.super->nFeatures |= CS1550_FEATURE_DIR_CHAINS;
+		cache_mark_dirty(0);
+	}
+
+	d->blocks[d->nBlocks] = block;
+	__atomic_store_n(&d->nBlocks, d->nBlocks + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Take an empty slot in a directory, growing it by a block if it's
+// full. The caller holds the directory's lock for writing.
+static int dir_take_slot(struct cs1550_dir* d) {
+	if(d->nFree > 0) {
+		return d->free[--d->nFree];
+	}
+	if(d->high == d->nBlocks * dir_slots(d)) {
+		int res = dir_grow(d);
+		if(res < 0) {
+			return res;
+		}
+	}
+	return d->high++;
+}
+
+// Hashed index over every name on the disk so that a path can be
+// resolved without scanning the root and the directory block. A
+// directory is keyed on its name alone (dir is -1), a file on the
+// root slot of its directory plus its name and extension.
+struct cs1550_index_entry {
+	int dir;							//root slot of the parent, -1 for directories
+	char name[MAX_FILENAME + 1];		//directory name or file name
+	char ext[MAX_EXTENSION + 1];		//file extension, empty for directories
+	int slot;							//where the name lives: a root slot for
+										//directories, a files[] slot for files
+	struct cs1550_index_entry* next;	//next entry in the same bucket
+};
+
+struct cs1550_name_index {
+	struct cs1550_index_entry** buckets;
+	long nBuckets;	//always a power of two
+	long nEntries;
+	pthread_rwlock_t lock;	//lookups read, inserts write
+};
+
+static struct cs1550_name_index name_index;
+
+// FNV-1a over the parent slot, the name and the extension
+static unsigned long index_hash(int dir, const char* name, const char* ext) {
+	unsigned long hash = 14695981039346656037UL;
+	int i = 0;
+	for(i = 0; i < (int) sizeof(int); i++) {
+		hash = (hash ^ ((dir >> (i * 8)) & 0xff)) * 1099511628211UL;
+	}
+	for(; *name; name++) {
+		hash = (hash ^ (unsigned char) *name) * 1099511628211UL;
+	}
+	hash = (hash ^ '.') * 1099511628211UL;
+	for(; *ext; ext++) {
+		hash = (hash ^ (unsigned char) *ext) * 1099511628211UL;
+	}
+	return hash;
+}
+
+// Find a name in the index, or NULL if it isn't there
+static struct cs1550_index_entry* index_find(int dir, const char* name, const char* ext) {
+	if(name_index.buckets == NULL) {
+		return NULL;
+	}
+	struct cs1550_index_entry* e = name_index.buckets[index_hash(dir, name, ext) & (name_index.nBuckets - 1)];
+	for(; e != NULL; e = e->next) {
+		if(e->dir == dir && strcmp(e->name, name) == 0 && strcmp(e->ext, ext) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+// Double the number of buckets and move every entry over
+static int index_grow() {
+	long nBuckets = name_index.nBuckets ? name_index.nBuckets * 2 : 64;
+	struct cs1550_index_entry** buckets = calloc(nBuckets, sizeof(struct cs1550_index_entry*));
+	if(buckets == NULL) {
+		return -ENOMEM;
+	}
+
+	long i = 0;
+	for(i = 0; i < name_index.nBuckets; i++) {
+		struct cs1550_index_entry* e = name_index.buckets[i];
+		while(e != NULL) {
+			struct cs1550_index_entry* next = e->next;
+			long b = index_hash(e->dir, e->name, e->ext) & (nBuckets - 1);
+			e->next = buckets[b];
+			buckets[b] = e;
+			e = next;
+		}
+	}
+	free(name_index.buckets);
+	name_index.buckets = buckets;
+	name_index.nBuckets = nBuckets;
+	return 0;
+}
+
+// Add a name to the index
+static int index_insert(int dir, const char* name, const char* ext, int slot) {
+	pthread_rwlock_wrlock(&name_index.lock);
+
+	// Keep the chains short by growing once we average one per bucket
+	if(name_index.nEntries >= name_index.nBuckets) {
+		int res = index_grow();
+		if(res < 0 && name_index.buckets == NULL) {
+			pthread_rwlock_unlock(&name_index.lock);
+			return res;
+		}
+	}
+
+	struct cs1550_index_entry* e = malloc(sizeof(struct cs1550_index_entry));
+	if(e == NULL) {
+		pthread_rwlock_unlock(&name_index.lock);
+		return -ENOMEM;
+	}
+	e->dir = dir;
+	strncpy(e->name, name, MAX_FILENAME);
+	e->name[MAX_FILENAME] = '\0';
+	strncpy(e->ext, ext, MAX_EXTENSION);
+	e->ext[MAX_EXTENSION] = '\0';
+	e->slot = slot;
+
+	long b = index_hash(dir, name, ext) & (name_index.nBuckets - 1);
+	e->next = name_index.buckets[b];
+	name_index.buckets[b] = e;
+	name_index.nEntries++;
+	pthread_rwlock_unlock(&name_index.lock);
+	return 0;
+}
+
+// Take a name out of the index
+static void index_remove(int dir, const char* name, const char* ext) {
+	pthread_rwlock_wrlock(&name_index.lock);
+	if(name_index.buckets != NULL) {
+		struct cs1550_index_entry** link = &name_index.buckets[index_hash(dir, name, ext) & (name_index.nBuckets - 1)];
+		while(*link != NULL) {
+			struct cs1550_index_entry* e = *link;
+			if(e->dir == dir && strcmp(e->name, name) == 0 && strcmp(e->ext, ext) == 0) {
+				*link = e->next;
+				free(e);
+				name_index.nEntries--;
+				break;
+			}
+			link = &e->next;
+		}
+	}
+	pthread_rwlock_unlock(&name_index.lock);
+}
+
+// Free every entry in the index
+static void index_drop() {
+	long i = 0;
+	for(i = 0; i < name_index.nBuckets; i++) {
+		struct cs1550_index_entry* e = name_index.buckets[i];
+		while(e != NULL) {
+			struct cs1550_index_entry* next = e->next;
+			free(e);
+			e = next;
+		}
+	}
+	free(name_index.buckets);
+	pthread_rwlock_destroy(&name_index.lock);
+	memset(&name_index, 0, sizeof(name_index));
+}
+
+// Read in the root and every directory in it, and index all of them
+// and every file in them. Called once at mount, after the cache is loaded.
+static int index_build() {
+	pthread_rwlock_init(&name_index.lock, NULL);
+	int res = index_grow();
+	if(res == 0) {
+		res = dir_load(&cache.root_slots, cache.root_block);
+	}
+	if(res < 0) {
+		return res;
+	}
+
+	int i = 0;
+	for(i = 0; i < cache.root_slots.high; i++) {
+		// Skip the slots that aren't being used
+		struct cs1550_directory* entry = root_slot(i);
+		if(strcmp(entry->dname, "") == 0) {
+			continue;
+		}
+		res = index_insert(-1, entry->dname, "", i);
+		if(res < 0) {
+			return res;
+		}
+
+		// Now add every file in that directory. One whose blocks
+		// can't be found stays empty.
+		struct cs1550_dir* state = dir_state(i, 1);
+		if(state == NULL) {
+			return -ENOMEM;
+		}
+		res = dir_load(state, entry->nStartBlock);
+		if(res == -ENOMEM) {
+			return res;
+		}
+		struct cs1550_dir* d = get_directory(i);
+		long j = 0;
+		for(j = 0; d != NULL && j < d->high; j++) {
+			struct cs1550_file_directory* file = dir_file(d, j);
+			if(strcmp(file->fname, "") != 0) {
+				res = index_insert(i, file->fname, file->fext, j);
+				if(res < 0) {
+					return res;
+				}
+			} else if(file->nStartBlock != 0 || file->fsize != 0) {
+				// Unlinked while it was open, and never released. The
+				// slot is already free, the blocks and the count go now.
+				reclaim_queue(file->nStartBlock, cache.extents);
+				memset(file, 0, sizeof(struct cs1550_file_directory));
+				((cs1550_directory_entry*) disk_block(dir_block(d, j)))->nFiles--;
+				cache_mark_dirty(dir_block(d, j));
+			}
+		}
+	}
+	return 0;
+}
+
+// Find the root slot of a directory, or -1 if there isn't one
+static int find_directory(const char* dname) {
+	pthread_rwlock_rdlock(&name_index.lock);
+	struct cs1550_index_entry* e = index_find(-1, dname, "");
+	int slot = e ? e->slot : -1;
+	pthread_rwlock_unlock(&name_index.lock);
+	lookup_record(LOOKUP_DIRECTORY, slot >= 0);
+	return slot;
+}
+
+// Find the slot of a file within its directory, or -1 if there isn't one
+static int find_file(int dir, const char* fname, const char* fext) {
+	pthread_rwlock_rdlock(&name_index.lock);
+	struct cs1550_index_entry* e = index_find(dir, fname, fext);
+	int slot = e ? e->slot : -1;
+	pthread_rwlock_unlock(&name_index.lock);
+	lookup_record(LOOKUP_FILE, slot >= 0);
+	return slot;
+}
+
+// Split a path of the form /directory/filename.extension into its
+// parts. Returns how many levels the path has (0 for the root, 1 for
+// a directory, 2 for a file), -ENAMETOOLONG if a part doesn't fit in
+// 8.3, -EINVAL if the extension has a dot in it, or -ENOENT if the
+// path is deeper than our two levels.
+static int parse_path(const char* path, char* dir, char* fname, char* fext) {
+	strcpy(dir, "");
+	strcpy(fname, "");
+	strcpy(fext, "");
+
+	// Skip the leading slash
+	while(*path == '/') {
+		path++;
+	}
+	if(*path == '\0') {
+		return 0;
+	}
+
+	// Copy out the directory name
+	int len = strcspn(path, "/");
+	if(len > MAX_FILENAME) {
+		return -ENAMETOOLONG;
+	}
+	strncpy(dir, path, len);
+	dir[len] = '\0';
+	path += len;
+	while(*path == '/') {
+		path++;
+	}
+	if(*path == '\0') {
+		return 1;
+	}
+
+	// What's left is the file, which can't have any more levels
+	if(strchr(path, '/') != NULL) {
+		return -ENOENT;
+	}
+	len = strcspn(path, ".");
+	if(len > MAX_FILENAME) {
+		return -ENAMETOOLONG;
+	}
+	strncpy(fname, path, len);
+	fname[len] = '\0';
+	path += len;
+
+	// And the extension, if there is one. It can't hold another dot,
+	// or a/b.c.d would be stored as b with extension c.d
+	if(*path == '.') {
+		path++;
+		if(strchr(path, '.') != NULL) {
+			return -EINVAL;
+		}
+		if(strlen(path) > MAX_EXTENSION) {
+			return -ENAMETOOLONG;
+		}
+		strcpy(fext, path);
+	}
+	return 2;
+}
+
+
+// Readahead starts out asking for this many bytes past a sequential
+// read, and doubles every time up to the most it will ever ask for.
+// READAHEAD_MIN and READAHEAD_MAX are the same in whole blocks.
+#define READAHEAD_MIN_BYTES (4 * 1024)
+#define READAHEAD_MAX_BYTES (256 * 1024)
+#define READAHEAD_MIN ((READAHEAD_MIN_BYTES + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define READAHEAD_MAX ((READAHEAD_MAX_BYTES + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// An open file. open resolves the path once and hands this back to fuse
+// in fi->fh, so read and write can skip straight to the file and pick
+// up where the last call left off.
+struct cs1550_handle {
+	int dir;						//root slot of the file's directory
+	int file;						//slot of the file in its directory
+	struct cs1550_open_file* of;	//what open tied it to, NULL for a lookup
+	unsigned long gen;				//generation of the open file cur was built in
+	struct cs1550_file_cursor cur;	//where the last read or write got to
+	pthread_mutex_t lock;			//keeps reads sharing the handle off each other's cursor
+
+	off_t ra_offset;	//where the next read starts if reads are sequential
+	long ra_window;		//how many blocks the next readahead asks for
+	long ra_next;		//first block of the file readahead hasn't asked for
+};
+
+// Fill in a handle for the file at path. Returns -ENOENT if there is no
+// such file, or -EISDIR if the path is a directory.
+static int handle_init(struct cs1550_handle* h, const char* path) {
+	// Variables to store the path, file, and extension
+	char dir[MAX_FILENAME + 1];
+	char file_name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+
+	// Break the path up into its parts
+	int levels = parse_path(path, dir, file_name, ext);
+	if(levels < 0) {
+		return -ENOENT;
+	} else if(levels < 2) {
+		return -EISDIR;
+	}
+
+	// Find the directory and the file through the index
+	h->dir = find_directory(dir);
+	h->file = h->dir < 0 ? -1 : find_file(h->dir, file_name, ext);
+	if(h->file < 0) {
+		return -ENOENT;
+	}
+	cursor_reset(&h->cur);
+	h->of = NULL;
+	h->gen = 0;
+	h->ra_offset = 0;
+	h->ra_window = READAHEAD_MIN;
+	h->ra_next = 0;
+	return 0;
+}
+
+// Get the handle open put in fi->fh, if there is one
+static struct cs1550_handle* get_handle(struct fuse_file_info* fi) {
+	if(fi == NULL) {
+		return NULL;
+	}
+	return (struct cs1550_handle*) (uintptr_t) fi->fh;
+}
+
+// Get the directory entry for the file a handle is for
+static struct cs1550_file_directory* handle_file(struct cs1550_handle* h) {
+	return dir_file(get_directory(h->dir), h->file);
+}
+
+// Get the lock for the data of the file a handle is for
+static pthread_rwlock_t* handle_lock(struct cs1550_handle* h) {
+	return &file_lock(h->dir, h->file)->lock;
+}
+
+// Find the open file in a slot, or NULL if it isn't open. The caller
+// holds the file's lock.
+static struct cs1550_open_file* open_file_find(int dir, int file) {
+	struct cs1550_open_file* of = file_lock(dir, file)->open;
+	while(of != NULL && (of->dir != dir || of->file != file)) {
+		of = of->next;
+	}
+	return of;
+}
+
+// Tie a handle from open to its file. The lookup was made without the
+// file's lock, so make sure the name still leads to the same slot now
+// that we hold it. Returns -ENOENT if the file went in the meantime.
+static int handle_attach(struct cs1550_handle* h, const char* path) {
+	char dir[MAX_FILENAME + 1];
+	char file_name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+	parse_path(path, dir, file_name, ext);
+
+	pthread_rwlock_wrlock(handle_lock(h));
+	if(find_directory(dir) != h->dir || find_file(h->dir, file_name, ext) != h->file) {
+		pthread_rwlock_unlock(handle_lock(h));
+		return -ENOENT;
+	}
+
+	// The first handle on the file makes its open file
+	struct cs1550_open_file* of = open_file_find(h->dir, h->file);
+	if(of == NULL) {
+		of = malloc(sizeof(struct cs1550_open_file));
+		if(of == NULL) {
+			pthread_rwlock_unlock(handle_lock(h));
+			return -ENOMEM;
+		}
+		of->dir = h->dir;
+		of->file = h->file;
+		of->gen = __atomic_add_fetch(&open_file_gen, 1, __ATOMIC_RELAXED);
+		of->nHandles = 0;
+		of->removed = 0;
+		of->next = file_lock(h->dir, h->file)->open;
+		file_lock(h->dir, h->file)->open = of;
+	}
+	of->nHandles++;
+	h->of = of;
+	h->gen = of->gen;
+	pthread_rwlock_unlock(handle_lock(h));
+	return 0;
+}
+
+// Start a handle's cursor over if the file was truncated since the
+// cursor was last used. The caller holds the file's lock, and the
+// handle's own lock if other reads can share the handle.
+static void handle_check_cursor(struct cs1550_handle* h) {
+	if(h->of != NULL && h->gen != h->of->gen) {
+		cursor_forget(&h->cur);
+		h->gen = h->of->gen;
+	}
+}
+
+// Mark the open file in a slot as removed, so the last handle on it
+// frees the file. Returns 0 if the file isn't open, and it can be freed
+// right away. The caller holds the file's lock for writing.
+static int open_file_remove(int dir, int file) {
+	struct cs1550_open_file* of = open_file_find(dir, file);
+	if(of == NULL) {
+		return 0;
+	}
+	of->removed = 1;
+	return 1;
+}
+
+// Copy up to size bytes of a file starting at offset into buf. The
+// caller holds the file's lock. Returns how much was read.
+static int file_read(struct cs1550_handle* h, char *buf, size_t size, off_t offset) {
+	handle_check_cursor(h);
+
+	// This is the file that we want to read
+	struct cs1550_file_directory* file = handle_file(h);
+	if(file == NULL) {
+		return -EIO;
+	}
+	struct cs1550_file_directory file_directory = *file;
+
+	// Check that offset is <= to the file size
+	if(offset >= (off_t) file_directory.fsize) {
+		return 0;
+	}
+	// Don't read past the end of the file
+	if(size > file_directory.fsize - offset) {
+		size = file_directory.fsize - offset;
+	}
+
+	// Work out where each piece of the file sits on disk and gather
+	// neighbouring pieces into one span of the image, so each run of
+	// the file comes in with a single read straight into buf. All of
+	// the reads go to the backend together once we know them all.
+	struct cs1550_io_batch batch;
+	io_batch_init(&batch);
+	char* span_buf = buf;	//where the span we're building goes
+	off_t span_pos = 0;		//where it starts in the image
+	size_t span_len = 0;	//how long it is so far
+	size_t buf_size = 0;
+	while(buf_size < size) {
+		// Find the block we're up to, and how many blocks after
+		// it the cursor knows are right behind it on disk
+		long block_num = (offset + buf_size) / BLOCK_SIZE;
+		int block_offset = (offset + buf_size) % BLOCK_SIZE;
+		long block = file_block(&file_directory, block_num, &h->cur);
+		if(block < 0) {
+			io_batch_free(&batch);
+			return -EIO;
+		}
+		size_t len = (h->cur.run_end - block_num) * BLOCK_SIZE - block_offset;
+		if(len > size - buf_size) {
+			len = size - buf_size;
+		}
+
+		// Tack it onto the span if it follows on, otherwise
+		// read the span in and start a new one here
+		off_t pos = (off_t) block * BLOCK_SIZE + block_offset;
+		if(span_len > 0 && span_pos + (off_t) span_len == pos) {
+			span_len += len;
+		} else {
+			if(span_len > 0) {
+				int res = cached_read(&batch, span_buf, span_len, span_pos);
+				if(res < 0) {
+					io_batch_free(&batch);
+					return res;
+				}
+			}
+			span_buf = buf + buf_size;
+			span_pos = pos;
+			span_len = len;
+		}
+		buf_size += len;
+	}
+
+	// Add whatever is left over, then read it all in
+	int res = 0;
+	if(span_len > 0) {
+		res = cached_read(&batch, span_buf, span_len, span_pos);
+	}
+	if(res == 0) {
+		res = io_batch_submit(&batch);
+	}
+	if(res == 0) {
+		bcache_fill_batch(&batch);
+	}
+	io_batch_free(&batch);
+	return res < 0 ? res : (int) size;
+}
+
+// Copy size bytes from buf into a file starting at offset, adding blocks
+// as it grows. The caller holds the file's lock for writing. Returns how
+// much was written, which is short if the disk fills up. The new size
+// goes in *fsize, leaving the directory entry for the caller to update.
+static int file_write(struct cs1550_handle* h, const char *buf, size_t size, off_t offset, size_t* fsize) {
+	handle_check_cursor(h);
+
+	// This is the file we're writing to
+	struct cs1550_file_directory* file = handle_file(h);
+	if(file == NULL) {
+		return -EIO;
+	}
+	struct cs1550_file_directory file_directory = *file;
+	*fsize = file_directory.fsize;
+
+	// Check if the offset is bigger than our file size
+	if(offset > (off_t) file_directory.fsize) {
+		// It is, so return an error
+		return -EFBIG;
+	}
+
+	// We need to figure out what block the offset lands
+	// in and how far into it we start writing
+	long block_num = offset / BLOCK_SIZE;
+	int block_offset = offset % BLOCK_SIZE;
+	long last = -1;
+
+	// Write a block at a time, adding blocks
+	// to the file when we run past its end
+	size_t bytes_written = 0;
+	while(bytes_written < size) {
+		long block = file_block(&file_directory, block_num, &h->cur);
+		if(block < 0) {
+			// Need to allocate another block for this file
+			// so we need to find a block to write too
+			if(block_num > 0 && last < 0) {
+				last = file_block(&file_directory, block_num - 1, &h->cur);
+			}
+			block = file_extend(&file_directory, block_num, last, &h->cur);
+			if(block < 0) {
+				// Out of space, so stop with what we've written
+				break;
+			}
+		}
+
+		// Find the block so we can copy our data into it
+		char* disk_data = disk_block(block);
+		if(disk_data == NULL) {
+			break;
+		}
+		size_t len = BLOCK_SIZE - block_offset;
+		if(len > size - bytes_written) {
+			len = size - bytes_written;
+		}
+		memcpy(disk_data + block_offset, buf + bytes_written, len);
+		cache_mark_dirty(block);
+		bcache_update(block);
+
+		// Move on to the start of the next block
+		bytes_written += len;
+		last = block;
+		block_num++;
+		block_offset = 0;
+	}
+
+	// If we wrote past the old end, the file got bigger
+	if(offset + bytes_written > file_directory.fsize) {
+		*fsize = offset + bytes_written;
+	}
+
+	// If the disk filled up, only report what made it
+	if(bytes_written == 0 && size > 0) {
+		return -ENOSPC;
+	}
+	return bytes_written;
+}
+
+// Record a new size for the file a handle is for. Only the directory's
+// lock is taken here, so lookups never wait on the data being copied.
+static void file_set_size(struct cs1550_handle* h, size_t fsize) {
+	struct cs1550_file_directory* file = handle_file(h);
+	if(file == NULL || fsize <= file->fsize) {
+		return;
+	}
+	pthread_rwlock_wrlock(dir_lock(h->dir));
+	struct cs1550_dir* d = get_directory(h->dir);
+	if(d != NULL) {
+		file->fsize = fsize;
+		cache_mark_dirty(dir_block(d, h->file));
+	}
+	pthread_rwlock_unlock(dir_lock(h->dir));
+}
+
+// Get the write buffer for the file a handle is for, or NULL
+static struct cs1550_write_buffer* handle_wbuf(struct cs1550_handle* h) {
+	struct cs1550_write_buffer* wb = file_lock(h->dir, h->file)->wbufs;
+	while(wb != NULL && (wb->dir != h->dir || wb->file != h->file)) {
+		wb = wb->next;
+	}
+	return wb;
+}
+
+// How big the file is once its buffered writes are counted. The caller
+// holds the file's lock.
+static size_t file_size(struct cs1550_handle* h) {
+	struct cs1550_file_directory* file = handle_file(h);
+	struct cs1550_write_buffer* wb = handle_wbuf(h);
+	size_t fsize = file ? file->fsize : 0;
+	if(wb != NULL && wb->len > 0 && (size_t) wb->start + wb->len > fsize) {
+		fsize = wb->start + wb->len;
+	}
+	return fsize;
+}
+
+// Fill in the attributes of a file from its entry in a directory listing.
+// The caller holds the directory's lock, which comes after the file's,
+// so the file's lock can only be tried for. If someone else has it the
+// size is what the entry says, without the file's buffered writes.
+static void file_stat(int dir, int file, struct cs1550_file_directory* entry, struct stat* st) {
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = S_IFREG | 0666;
+	st->st_nlink = 1;
+	st->st_size = entry->fsize;
+
+	struct cs1550_handle h;
+	h.dir = dir;
+	h.file = file;
+	if(pthread_rwlock_tryrdlock(handle_lock(&h)) == 0) {
+		st->st_size = file_size(&h);
+		pthread_rwlock_unlock(handle_lock(&h));
+	}
+}
+
+// Put what's waiting in a file's write buffer into the image and update
+// the file's size. The buffer itself is kept for the next write unless
+// release is set. The caller holds the file's lock for writing.
+static int wbuf_flush(struct cs1550_handle* h, int release) {
+	struct cs1550_write_buffer* wb = handle_wbuf(h);
+	if(wb == NULL) {
+		return 0;
+	}
+
+	// The blocks this dirties are the writes' doing, whatever
+	// sends the buffer out
+	int res = 0;
+	if(wb->len > 0) {
+		int source = io_source;
+		io_source = OP_WRITE;
+		size_t fsize = 0;
+		res = file_write(h, wb->data, wb->len, wb->start, &fsize);
+		file_set_size(h, fsize);
+		io_source = source;
+		if(res >= 0 && (size_t) res < wb->len) {
+			//the disk filled up part way through
+			res = -ENOSPC;
+		}
+		wb->len = 0;
+	}
+
+	// Hand the memory back if we're done with it
+	if(release) {
+		struct cs1550_write_buffer** link = &file_lock(h->dir, h->file)->wbufs;
+		while(*link != wb) {
+			link = &(*link)->next;
+		}
+		*link = wb->next;
+		__atomic_sub_fetch(&write_buffer_bytes, sizeof(struct cs1550_write_buffer), __ATOMIC_RELAXED);
+		free(wb);
+	}
+	return res < 0 ? res : 0;
+}
+
+// Get a write buffer for a file, making one if it doesn't have one and
+// there's memory to spare. Returns NULL if the write should go straight
+// into the image.
+static struct cs1550_write_buffer* wbuf_get(struct cs1550_handle* h) {
+	struct cs1550_write_buffer* wb = handle_wbuf(h);
+	if(wb != NULL) {
+		return wb;
+	}
+
+	// Stay under the limit
+	long used = __atomic_add_fetch(&write_buffer_bytes, sizeof(struct cs1550_write_buffer), __ATOMIC_RELAXED);
+	if(used > WRITE_BUFFER_LIMIT || (wb = malloc(sizeof(struct cs1550_write_buffer))) == NULL) {
+		__atomic_sub_fetch(&write_buffer_bytes, sizeof(struct cs1550_write_buffer), __ATOMIC_RELAXED);
+		return NULL;
+	}
+	wb->dir = h->dir;
+	wb->file = h->file;
+	wb->start = 0;
+	wb->len = 0;
+	wb->next = file_lock(h->dir, h->file)->wbufs;
+	file_lock(h->dir, h->file)->wbufs = wb;
+	return wb;
+}
+
+// Copy the part of a file's write buffer that falls inside a read over
+// what came from the image. n is how much the image gave us, and the
+// return value is how much of the read is now filled in.
+static int wbuf_overlay(struct cs1550_handle* h, char* buf, size_t size, off_t offset, int n) {
+	struct cs1550_write_buffer* wb = handle_wbuf(h);
+	if(wb == NULL || wb->len == 0) {
+		return n;
+	}
+
+	// The part of the read the buffer covers
+	off_t from = offset > wb->start ? offset : wb->start;
+	off_t to = wb->start + (off_t) wb->len;
+	if(to > offset + (off_t) size) {
+		to = offset + size;
+	}
+	if(from >= to) {
+		return n;
+	}
+	memcpy(buf + (from - offset), wb->data + (from - wb->start), to - from);
+
+	// The buffer never starts past the end of what's in the image,
+	// so anything it adds on runs on right from the image's data
+	if(to - offset > n) {
+		n = to - offset;
+	}
+	return n;
+}
+
+// Empty slot n of a directory whose name is already gone, and give it
+// back. Returns the first block of what the file held, for the caller
+// to hand to the reclaimer once it lets go of its locks. The caller
+// holds the file's lock and the directory's lock for writing.
+static long file_forget(struct cs1550_dir* d, long n) {
+	struct cs1550_file_directory* file = dir_file(d, n);
+	long block = file->nStartBlock;
+	memset(file, 0, sizeof(struct cs1550_file_directory));
+	cache_mark_dirty(dir_block(d, n));
+	dir_put_slot(d, n);
+	dir_count(d, n, -1);
+	return block;
+}
+
+// Let go of a handle's open file, and free it with the last handle.
+// If the file was unlinked in the meantime it goes with it, along with
+// whatever it still had buffered.
+static void handle_detach(struct cs1550_handle* h) {
+	struct cs1550_open_file* of = h->of;
+	if(of == NULL) {
+		return;
+	}
+	long block = EOF;
+	int removed = 0;
+	pthread_rwlock_wrlock(handle_lock(h));
+	if(--of->nHandles == 0) {
+		struct cs1550_open_file** link = &file_lock(h->dir, h->file)->open;
+		while(*link != NULL && *link != of) {
+			link = &(*link)->next;
+		}
+		if(*link == of) {
+			*link = of->next;
+		}
+		removed = of->removed;
+		free(of);
+	}
+	if(removed) {
+		struct cs1550_write_buffer* wb = handle_wbuf(h);
+		if(wb != NULL) {
+			wb->len = 0;
+			wbuf_flush(h, 1);
+		}
+		pthread_rwlock_wrlock(dir_lock(h->dir));
+		block = file_forget(get_directory(h->dir), h->file);
+		pthread_rwlock_unlock(dir_lock(h->dir));
+	}
+	pthread_rwlock_unlock(handle_lock(h));
+	h->of = NULL;
+	if(removed) {
+		reclaim_queue(block, cache.extents);
+	}
+}
+
+// Write buffered data for the file at path (or the file open in fi) into
+// the image and give its buffer back, then write back every dirty block.
+static int flush_file(const char* path, struct fuse_file_info* fi) {
+	// The stats file has nothing to write, and a write back here
+	// would change the counters being read
+	if(stats_path(path)) {
+		return 0;
+	}
+
+	// Use the handle from open if we have one, otherwise
+	// look the file up just for this call
+	struct cs1550_handle local;
+	struct cs1550_handle* h = get_handle(fi);
+	if(h == NULL && handle_init(&local, path) == 0) {
+		h = &local;
+	}
+
+	int res = 0;
+	if(h != NULL) {
+		pthread_rwlock_wrlock(handle_lock(h));
+		res = wbuf_flush(h, 1);
+		pthread_rwlock_unlock(handle_lock(h));
+	}
+
+	//push the blocks we've changed out to .disk
+	int wres = cache_writeback();
+	return res < 0 ? res : wres;
+}
+
+// Readahead. When reads through a handle carry on from where the last
+// one stopped, the blocks after them are fetched into the block cache
+// by a background thread so the next read finds them there. Every
+// batch asks for twice as much as the one before, up to READAHEAD_MAX,
+// and a read somewhere else starts the window over.
+#define READAHEAD_QUEUE 64
+
+struct cs1550_readahead_request {
+	int dir;						//root slot of the file
+	int file;						//slot of the file in its directory
+	unsigned long gen;				//generation of the open file it's for
+	long n;							//first block of the file to fetch
+	long count;						//how many blocks to fetch
+	struct cs1550_file_cursor cur;	//where the reader's cursor was, to start from
+};
+
+struct cs1550_readahead {
+	struct cs1550_readahead_request queue[READAHEAD_QUEUE];
+	int head;				//next request to handle
+	int nQueued;			//how many requests are waiting
+	int running;			//cleared to make the thread stop
+	int started;			//set once the thread is going
+	pthread_t thread;
+	pthread_mutex_t lock;	//held while using the queue
+	pthread_cond_t wake;	//signalled when there's something to do
+};
+
+static struct cs1550_readahead readahead;
+
+// Add a read for each run of count blocks of the image from block first
+// on that isn't already in the cache. Each one reads into the next free
+// part of tmp, and *used says how many blocks of tmp are taken.
+static int bcache_prefetch(struct cs1550_io_batch* batch, long first, long count, char* tmp, long* used) {
+	long miss = -1;
+	long k = 0;
+	for(k = first; k <= first + count; k++) {
+		long slot = -1;
+		if(k < first + count) {
+			pthread_mutex_lock(&bcache.lock);
+			slot = bcache_find(k);
+			pthread_mutex_unlock(&bcache.lock);
+		}
+		if(slot < 0 && k < first + count) {
+			if(miss < 0) {
+				miss = k;
+			}
+		} else if(miss >= 0) {
+			int res = io_batch_add(batch, IO_READ, tmp + *used * BLOCK_SIZE, (k - miss) * BLOCK_SIZE, (off_t) miss * BLOCK_SIZE);
+			if(res < 0) {
+				return res;
+			}
+			*used += k - miss;
+			miss = -1;
+		}
+	}
+	return 0;
+}
+
+// Fetch the blocks a readahead request asks for
+static void readahead_run(struct cs1550_readahead_request* req, char* tmp) {
+	struct cs1550_handle h;
+	h.dir = req->dir;
+	h.file = req->file;
+	h.of = NULL;
+	h.cur = req->cur;
+
+	// Hold the file still so nothing we cache can go stale. If
+	// it was unlinked since, the cursor is for blocks it gave up.
+	pthread_rwlock_rdlock(handle_lock(&h));
+	struct cs1550_open_file* of = open_file_find(h.dir, h.file);
+	struct cs1550_file_directory* file = handle_file(&h);
+	if(of == NULL || of->gen != req->gen || file == NULL) {
+		pthread_rwlock_unlock(handle_lock(&h));
+		return;
+	}
+	struct cs1550_file_directory file_directory = *file;
+
+	// Don't go past the blocks the file has in the image
+	long nBlocks = (file_directory.fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long end = req->n + req->count < nBlocks ? req->n + req->count : nBlocks;
+
+	// Gather up a read for every run of the file we don't have
+	struct cs1550_io_batch batch;
+	io_batch_init(&batch);
+	long used = 0;
+	long n = req->n;
+	while(n < end) {
+		long block = file_block(&file_directory, n, &h.cur);
+		if(block < 0) {
+			break;
+		}
+		long run = h.cur.run_end - n;
+		if(run > end - n) {
+			run = end - n;
+		}
+		if(bcache_prefetch(&batch, block, run, tmp, &used) < 0) {
+			break;
+		}
+		n += run;
+	}
+
+	// Then fetch them all at once
+	if(io_batch_submit(&batch) == 0) {
+		bcache_fill_batch(&batch);
+		__atomic_add_fetch(&bcache_stats.readahead, used, __ATOMIC_RELAXED);
+	}
+	io_batch_free(&batch);
+	pthread_rwlock_unlock(handle_lock(&h));
+}
+
+// The readahead thread. Waits for requests and handles them in order.
+static void* readahead_thread(void* arg) {
+	(void) arg;
+	io_source = IO_READAHEAD;
+	char* tmp = malloc(READAHEAD_MAX * BLOCK_SIZE);
+	if(tmp == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&readahead.lock);
+	while(readahead.running) {
+		if(readahead.nQueued == 0) {
+			pthread_cond_wait(&readahead.wake, &readahead.lock);
+			continue;
+		}
+
+		// Take the next request and fetch it without the queue locked
+		struct cs1550_readahead_request req = readahead.queue[readahead.head];
+		readahead.head = (readahead.head + 1) % READAHEAD_QUEUE;
+		readahead.nQueued--;
+		pthread_mutex_unlock(&readahead.lock);
+		readahead_run(&req, tmp);
+		pthread_mutex_lock(&readahead.lock);
+	}
+	pthread_mutex_unlock(&readahead.lock);
+	free(tmp);
+	return NULL;
+}
+
+// Start the readahead thread. Only worth it when there's a cache to fill.
+static void readahead_start() {
+	memset(&readahead, 0, sizeof(readahead));
+	pthread_mutex_init(&readahead.lock, NULL);
+	pthread_cond_init(&readahead.wake, NULL);
+	if(bcache.nSlots == 0) {
+		return;
+	}
+	readahead.running = 1;
+	if(pthread_create(&readahead.thread, NULL, readahead_thread, NULL) == 0) {
+		readahead.started = 1;
+	} else {
+		readahead.running = 0;
+	}
+}
+
+// Stop the readahead thread and drop anything it hadn't got to
+static void readahead_stop() {
+	pthread_mutex_lock(&readahead.lock);
+	readahead.running = 0;
+	pthread_cond_signal(&readahead.wake);
+	pthread_mutex_unlock(&readahead.lock);
+	if(readahead.started) {
+		pthread_join(readahead.thread, NULL);
+	}
+	pthread_cond_destroy(&readahead.wake);
+	pthread_mutex_destroy(&readahead.lock);
+	memset(&readahead, 0, sizeof(readahead));
+}
+
+// Note that n bytes were just read through a handle from offset, and
+// ask for the next batch of blocks if reads have been sequential and
+// are catching up with what was asked for last time. The caller holds
+// the file's lock and the handle's lock.
+static void readahead_note(struct cs1550_handle* h, off_t offset, int n) {
+	if(!readahead.running || n <= 0) {
+		return;
+	}
+
+	// A read somewhere else starts the window over
+	if(offset != h->ra_offset) {
+		h->ra_window = READAHEAD_MIN;
+		h->ra_next = 0;
+		h->ra_offset = offset + n;
+		return;
+	}
+	h->ra_offset = offset + n;
+
+	// Wait until the reader is within half a window of
+	// the end of what's been asked for
+	long end = (offset + n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(h->ra_next < end) {
+		h->ra_next = end;
+	}
+	if(h->ra_next - end > h->ra_window / 2) {
+		return;
+	}
+
+	// Don't ask for more than the file has
+	struct cs1550_file_directory* file = handle_file(h);
+	long nBlocks = file ? (long) ((file->fsize + BLOCK_SIZE - 1) / BLOCK_SIZE) : 0;
+	long count = h->ra_window < nBlocks - h->ra_next ? h->ra_window : nBlocks - h->ra_next;
+	if(count <= 0) {
+		return;
+	}
+
+	// Queue it up, unless the thread is too far behind to bother
+	pthread_mutex_lock(&readahead.lock);
+	if(readahead.nQueued < READAHEAD_QUEUE) {
+		struct cs1550_readahead_request* req = &readahead.queue[(readahead.head + readahead.nQueued) % READAHEAD_QUEUE];
+		req->dir = h->dir;
+		req->file = h->file;
+		req->gen = h->of != NULL ? h->of->gen : 0;
+		req->n = h->ra_next;
+		req->count = count;
+		req->cur = h->cur;
+		req->cur.map = NULL;
+		req->cur.nMapped = 0;
+		req->cur.map_cap = 0;
+		readahead.nQueued++;
+		pthread_cond_signal(&readahead.wake);
+	}
+	pthread_mutex_unlock(&readahead.lock);
+
+	h->ra_next += count;
+	if(h->ra_window < READAHEAD_MAX) {
+		h->ra_window = h->ra_window * 2 < READAHEAD_MAX ? h->ra_window * 2 : READAHEAD_MAX;
+	}
+}
+
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not. 
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+	int res = 0;
+		
+	// Variables to store path
+	char dir[MAX_FILENAME + 1];
+	char file_name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+
+	// Clear stat buffer
+	memset(stbuf, 0, sizeof(struct stat));
+
+	// The stats file is made up on the spot, so its size is
+	// however long the stats are right now
+	if(stats_path(path)) {
+		char stats[STATS_SIZE];
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = stats_render(stats);
+		return res;
+	}
+
+	// Break the path up into its parts
+	int levels = parse_path(path, dir, file_name, ext);
+	if(levels < 0) {
+		// A name that can't be stored can't exist
+		res = -ENOENT;
+		return res;
+	}
+
+	//Check if path is root
+	if(levels == 0) {
+		// If it is set the directory mode to 
+		// directory
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		return res;
+	}
+
+	// Since we're not in root, we need to find the correct 
+	// directory in the index
+	int slot = find_directory(dir);
+
+	// Check if the directory was found
+	if(slot < 0) {
+		// It was not so return ENOENT error
+		res = -ENOENT;
+		return res;
+	}
+
+	// No where left to go
+	if(levels == 1) {
+		// Return a success and
+		// the appropriate permissions
+		res = 0;
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		return res; 
+	}
+
+	// Look the file up in the index
+	int file_slot = find_file(slot, file_name, ext);
+
+	// Check if a file was found
+	if(file_slot < 0) { 
+		// It was not found so return ENOENT error
+		res = -ENOENT;
+		return res;
+	}
+
+	// File was found, so return success
+	stbuf->st_mode = S_IFREG | 0666;
+	stbuf->st_nlink = 1;
+
+	// The size counts anything still sitting in the file's write buffer
+	struct cs1550_handle h;
+	h.dir = slot;
+	h.file = file_slot;
+	pthread_rwlock_rdlock(handle_lock(&h));
+	pthread_rwlock_rdlock(dir_lock(slot));
+	stbuf->st_size = file_size(&h);
+	pthread_rwlock_unlock(dir_lock(slot));
+	pthread_rwlock_unlock(handle_lock(&h));
+	return res;
+}
+
+/* 
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	//Since we're building with -Wall (all warnings reported) we need
+	//to "use" every parameter, so let's just cast them to void to
+	//satisfy the compiler
+	(void) fi;
+
+	// Variables to store path
+	char dir[MAX_FILENAME + 1];
+	char file_name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+
+	// Break the path up into its parts, only the root
+	// and directories can be listed
+	int levels = parse_path(path, dir, file_name, ext);
+	if(levels < 0) {
+		return -ENOENT;
+	} else if(levels == 2) {
+		return -ENOTDIR;
+	}
+
+	// Find the directory before we start filling anything in
+	int slot = -1;
+	if(levels == 1) {
+		slot = find_directory(dir);
+		if(slot < 0) {
+			return -ENOENT;
+		}
+	}
+
+	//the filler function allows us to add entries to the listing
+	//read the fuse.h file for a description (in the ../include dir).
+	//Every entry goes in with its attributes, so listing a directory
+	//doesn't take a getattr for each thing in it, and with the offset
+	//to carry on from after it. Those are 1 for ".", 2 for ".." and
+	//a slot plus 3 for whatever is in that slot. Slots never move, so
+	//a listing picks up where it stopped even if things came and went
+	//in between. The filler says when it's full by returning 1.
+	struct stat st;
+	memset(&st, 0, sizeof(struct stat));
+	st.st_mode = S_IFDIR | 0755;
+	st.st_nlink = 2;
+	if(offset < 1 && filler(buf, ".", &st, 1) != 0) {
+		return 0;
+	}
+	if(offset < 2 && filler(buf, "..", &st, 2) != 0) {
+		return 0;
+	}
+	long first = offset > 2 ? offset - 2 : 0;
+
+	// Check if the current path is root
+	if(levels == 0) {
+		long i = 0;
+		
+		cs1550_root_directory* root_dir = get_root_dir();
+		if(root_dir == NULL) {
+			return -EIO;
+		}
+
+		// Check all directories in root
+		pthread_rwlock_rdlock(&cache.root_lock);
+		for(i = first; i < cache.root_slots.high; i++){ 
+			// Check if the current directory is empty
+			struct cs1550_directory* curr_dir = root_slot(i);
+			if(strcmp(curr_dir->dname, "") != 0) {
+				// If it does, print it
+				if(filler(buf, curr_dir->dname, &st, i + 3) != 0) {
+					break;
+				}
+			}
+		}
+		pthread_rwlock_unlock(&cache.root_lock);
+	} else {
+		long i = 0;
+		// Loop over the files in the directory, in the order of
+		// their slots, and print them out
+		pthread_rwlock_rdlock(dir_lock(slot));
+		struct cs1550_dir* d = get_directory(slot);
+		for(i = first; d != NULL && i < d->high; i++) {
+			// Variable to store the current  
+			struct cs1550_file_directory* curr_file_dir = dir_file(d, i);
+			// Check if the file is empty
+			if(strcmp(curr_file_dir->fname, "") == 0){
+				continue;
+			}
+			// Variable to store the file name, with
+			// room for the dot and the extension
+			char full_file_name[MAX_FILENAME + MAX_EXTENSION + 2];
+			strcpy(full_file_name, curr_file_dir->fname);
+			// Check if the file has an extension
+			if(strcmp(curr_file_dir->fext, "") != 0) {
+				// If so, append it
+				strcat(full_file_name, ".");
+				strcat(full_file_name, curr_file_dir->fext);
+			}
+			// Print it
+			file_stat(slot, i, curr_file_dir, &st);
+			if(filler(buf, full_file_name, &st, i + 3) != 0) {
+				break;
+			}
+		}
+		pthread_rwlock_unlock(dir_lock(slot));
+	}
+	return 0;
+}
+
+/* 
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+	(void) mode;
+	// Variables to store the directory
+	// and its subdirectory
+	char dir[MAX_FILENAME + 1];
+	char sub[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+
+	// Derived from the path
+	int levels = parse_path(path, dir, sub, ext);
+
+	// Check if the directory name is too big
+	if(levels == -ENAMETOOLONG) {
+		// If it is, return an error
+		return -ENAMETOOLONG;
+	} else if(levels != 1) {
+		// The user cannot pass in a subdirectory
+		// If they do, deny permission
+		return -EPERM;
+	} else if(strcmp(dir, STATS_PATH + 1) == 0) {
+		// The name is taken by the stats file
+		return -EEXIST;
+	}
+
+	// Variable to store the root directory
+	cs1550_root_directory* root_directory = get_root_dir();
+	if(root_directory == NULL) {
+		return -EIO;
+	}
+
+	// Only one thread gets to change the root at a time
+	pthread_rwlock_wrlock(&cache.root_lock);
+
+	// Check if the directory the user wants to
+	// create already exists
+	if(find_directory(dir) >= 0) {
+		// If it does, return an error
+		pthread_rwlock_unlock(&cache.root_lock);
+		return -EEXIST;
+	}
+
+	// Take a nameless slot in the root to store the new directory,
+	// which adds a block to the root if it's full
+	int i = dir_take_slot(&cache.root_slots);
+	if(i < 0) {
+		pthread_rwlock_unlock(&cache.root_lock);
+		return i;
+	}
+	struct cs1550_dir* state = dir_state(i, 1);
+
+	struct cs1550_directory new_dir;
+	// Add the users directory name to the 
+	// new directory's name
+	strcpy(new_dir.dname, dir);
+	// Find a new block to store the directory in
+	new_dir.nStartBlock = alloc_block();
+	if(state == NULL || new_dir.nStartBlock < 0) {
+		// Out of memory, or the disk is full
+		free_block(new_dir.nStartBlock);
+		dir_put_slot(&cache.root_slots, i);
+		pthread_rwlock_unlock(&cache.root_lock);
+		return state == NULL ? -ENOMEM : -ENOSPC;
+	}
+
+	// Get the block for the new directory from the image
+	int res = 0;
+	cs1550_directory_entry* new_entry = disk_block(new_dir.nStartBlock);
+
+	// Check if the block is on the disk
+	if(new_entry != NULL) {
+		 // Clear out the new directory in place
+		memset(new_entry, 0, BLOCK_SIZE);
+		cache_mark_dirty(new_dir.nStartBlock);
+
+		// Set up the slot's directory, which is empty
+		// until it goes in the root
+		pthread_rwlock_wrlock(dir_lock(i));
+		res = dir_load(state, new_dir.nStartBlock);
+		pthread_rwlock_unlock(dir_lock(i));
+	} else {
+		// Error with the disk
+		res = -EIO;
+	}
+
+	if(res == 0) {
+		// Update root with an new directory
+		*root_slot(i) = new_dir;
+		dir_count(&cache.root_slots, i, 1);
+
+		// And make it findable
+		index_insert(-1, dir, "", i);
+	} else {
+		// Give the block and the slot back
+		free_block(new_dir.nStartBlock);
+		dir_put_slot(&cache.root_slots, i);
+	}
+	pthread_rwlock_unlock(&cache.root_lock);
+	return res;
+}
+
+/* 
+ * Removes a directory. Only an empty directory can go, and its blocks
+ * are left for the reclaimer to give back.
+ */
+static int cs1550_rmdir(const char *path)
+{
+	char dir[MAX_FILENAME + 1];
+	char file_name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+
+	// Only a directory can be removed here
+	int levels = parse_path(path, dir, file_name, ext);
+	if(levels < 0 && levels != -ENAMETOOLONG) {
+		return -ENOENT;
+	} else if(levels < 0) {
+		return levels;
+	} else if(levels == 0) {
+		return -EBUSY;
+	} else if(levels == 2) {
+		return -ENOTDIR;
+	}
+
+	cs1550_root_directory* root_dir = get_root_dir();
+	if(root_dir == NULL) {
+		return -EIO;
+	}
+
+	// The root changes, and so does the directory, which nothing
+	// may be adding a file to while we look at it
+	pthread_rwlock_wrlock(&cache.root_lock);
+	int slot = find_directory(dir);
+	if(slot < 0) {
+		pthread_rwlock_unlock(&cache.root_lock);
+		return -ENOENT;
+	}
+	pthread_rwlock_wrlock(dir_lock(slot));
+
+	struct cs1550_dir* d = get_directory(slot);
+	int res = 0;
+	if(d != NULL && d->nUsed > 0) {
+		res = -ENOTEMPTY;
+	}
+
+	if(res == 0) {
+		// Take it out of the root and forget about its blocks. The
+		// slot keeps its lists for the next directory to use it.
+		struct cs1550_directory* entry = root_slot(slot);
+		long block = entry->nStartBlock;
+		index_remove(-1, dir, "");
+		memset(entry, 0, sizeof(struct cs1550_directory));
+		dir_put_slot(&cache.root_slots, slot);
+		dir_count(&cache.root_slots, slot, -1);
+		if(d != NULL) {
+			__atomic_store_n(&d->nBlocks, 0, __ATOMIC_RELEASE);
+		}
+		reclaim_queue(block, 0);
+	}
+	pthread_rwlock_unlock(dir_lock(slot));
+	pthread_rwlock_unlock(&cache.root_lock);
+	return res;
+}
+
+/* 
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	(void) mode;
+	(void) dev;
+	
+	//path will be in the format of /directory/sub_directory
+	// Variables to store the directory, file name
+	// and file extension
+	char dir[MAX_FILENAME + 1]; //The first directory in the 2-level file system
+	char file_name[MAX_FILENAME + 1]; //The directory within the root's directory	
+	char ext[MAX_EXTENSION + 1];
+
+	int levels = parse_path(path, dir, file_name, ext);
+
+	// Check if the file name or extension is too long, or the
+	// extension has a dot of its own
+	if(levels == -ENAMETOOLONG || levels == -EINVAL) {
+		// If they are return an error
+		return levels;
+	}
+
+	// Files can only go in a directory and need a name
+	if(levels != 2 || strcmp(file_name, "") == 0) {
+		return -EPERM;
+	}
+
+	// Get data for the root directory
+	// and store it
+	cs1550_root_directory* root_dir = get_root_dir();
+	if(root_dir == NULL) {
+		return -EIO;
+	}
+
+	// Find the directory we are adding to
+	int slot = find_directory(dir);
+	if(slot < 0) {
+		return -ENOENT;
+	}
+
+	// Only one thread gets to change the directory at a time
+	pthread_rwlock_wrlock(dir_lock(slot));
+
+	// The directory might have been removed while we waited
+	struct cs1550_dir* d = get_directory(slot);
+	if(d == NULL || find_directory(dir) != slot) {
+		pthread_rwlock_unlock(dir_lock(slot));
+		return -ENOENT;
+	}
+
+	// Check if the file with the same name and extension already exists in the directory
+	if(find_file(slot, file_name, ext) >= 0) {
+		// File already exists, so return
+		// an error
+		pthread_rwlock_unlock(dir_lock(slot));
+		return -EEXIST;
+	}
+
+	// Take an empty slot, which adds a block to the
+	// directory if it's full
+	int first_free_index = dir_take_slot(d);
+	if(first_free_index < 0) {
+		pthread_rwlock_unlock(dir_lock(slot));
+		return first_free_index;
+	}
+
+	// We're good to create it
+	// Grab the first block for the file out of the table. With
+	// extents that's an empty extent block instead of data.
+	long start_block = alloc_block();
+	if(start_block < 0) {
+		// The disk is full
+		dir_put_slot(d, first_free_index);
+		pthread_rwlock_unlock(dir_lock(slot));
+		return -ENOSPC;
+	}
+	if(cache.extents) {
+		memset(disk_block(start_block), 0, BLOCK_SIZE);
+		cache_mark_dirty(start_block);
+	}
+
+	// Variable to store the new file
+	struct cs1550_file_directory new_file;
+	// Copy over the file name that we want to create
+	strcpy(new_file.fname, file_name);
+	// Copy over the file extension, which is an
+	// empty string if there isn't one
+	strcpy(new_file.fext, ext);
+	// Initialize new file fields
+	new_file.fsize = 0;
+	new_file.nStartBlock = start_block;
+
+	// Use saved index to store teh new file
+	*dir_file(d, first_free_index) = new_file;
+	// Increase number files in the directory
+	dir_count(d, first_free_index, 1);
+
+	// And make it findable
+	index_insert(slot, file_name, ext, first_free_index);
+	pthread_rwlock_unlock(dir_lock(slot));
+	return 0;
+}
+
+/*
+ * Deletes a file. The name goes right away, while the file's blocks
+ * are left for the reclaimer to give back, so this takes no longer
+ * for a big file than for an empty one.
+ */
+static int cs1550_unlink(const char *path)
+{
+	char dir[MAX_FILENAME + 1];
+	char file_name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+
+	// Only a file can be removed here
+	int levels = parse_path(path, dir, file_name, ext);
+	if(levels < 0 && levels != -ENAMETOOLONG) {
+		return -ENOENT;
+	} else if(levels < 0) {
+		return levels;
+	} else if(levels < 2) {
+		return -EISDIR;
+	}
+
+	struct cs1550_handle h;
+	h.dir = find_directory(dir);
+	h.file = h.dir < 0 ? -1 : find_file(h.dir, file_name, ext);
+	if(h.file < 0) {
+		return -ENOENT;
+	}
+	h.of = NULL;
+	cursor_reset(&h.cur);
+
+	// Nothing can be reading or writing the file while it goes, then
+	// make sure it's still the same file now that we hold the locks
+	pthread_rwlock_wrlock(handle_lock(&h));
+	pthread_rwlock_wrlock(dir_lock(h.dir));
+	struct cs1550_file_directory* file = handle_file(&h);
+	if(file == NULL || find_directory(dir) != h.dir || find_file(h.dir, file_name, ext) != h.file) {
+		pthread_rwlock_unlock(dir_lock(h.dir));
+		pthread_rwlock_unlock(handle_lock(&h));
+		return -ENOENT;
+	}
+
+	// The name goes either way. A file that's still open keeps its
+	// slot and its blocks until the last handle on it is released, so
+	// only the name is cleared on disk. One left like that by a crash
+	// is freed at the next mount.
+	index_remove(h.dir, file_name, ext);
+	if(open_file_remove(h.dir, h.file)) {
+		memset(file->fname, 0, sizeof(file->fname));
+		memset(file->fext, 0, sizeof(file->fext));
+		cache_mark_dirty(dir_block(get_directory(h.dir), h.file));
+		pthread_rwlock_unlock(dir_lock(h.dir));
+		pthread_rwlock_unlock(handle_lock(&h));
+		return 0;
+	}
+
+	// Otherwise whatever it still had buffered has nowhere to go, and
+	// the slot can be used again
+	struct cs1550_write_buffer* wb = handle_wbuf(&h);
+	if(wb != NULL) {
+		wb->len = 0;
+		wbuf_flush(&h, 1);
+	}
+	long block = file_forget(get_directory(h.dir), h.file);
+	pthread_rwlock_unlock(dir_lock(h.dir));
+	pthread_rwlock_unlock(handle_lock(&h));
+
+	reclaim_queue(block, cache.extents);
+	return 0;
+}
+
+/* 
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	//check to make sure path exists
+	//check that size is > 0
+	//check that offset is <= to the file size
+	//read in data
+	//set size and return, or error
+
+	// Use the handle from open if we have one, otherwise
+	// look the file up just for this call
+	struct cs1550_handle local;
+	struct cs1550_handle* h = get_handle(fi);
+	if(h == NULL && stats_path(path)) {
+		// Hand out the part of the stats that was asked for
+		char stats[STATS_SIZE];
+		int len = stats_render(stats);
+		if(offset >= len) {
+			return 0;
+		}
+		if(size > (size_t) (len - offset)) {
+			size = len - offset;
+		}
+		memcpy(buf, stats + offset, size);
+		return size;
+	} else if(h == NULL) {
+		int res = handle_init(&local, path);
+		if(res < 0) {
+			return res;
+		}
+		h = &local;
+	}
+
+	// Other reads of this file can go on at the same time,
+	// but only one at a time gets to move this handle's cursor
+	pthread_rwlock_rdlock(handle_lock(h));
+	if(h != &local) {
+		pthread_mutex_lock(&h->lock);
+	}
+	int res = file_read(h, buf, size, offset);
+	if(res >= 0) {
+		// Anything still in the write buffer is newer than the image
+		res = wbuf_overlay(h, buf, size, offset, res);
+	}
+	if(h != &local) {
+		// Fetch what comes next if this looks like a stream
+		readahead_note(h, offset, res);
+		pthread_mutex_unlock(&h->lock);
+	}
+	pthread_rwlock_unlock(handle_lock(h));
+	return res;
+}
+
+/* 
+ * Write size bytes from buf into file starting from offset
  *
  */
+static int cs1550_write(const char *path, const char *buf, size_t size, 
+			  off_t offset, struct fuse_file_info *fi)
+{
+	// Use the handle from open if we have one, otherwise
+	// look the file up just for this call
+	struct cs1550_handle local;
+	struct cs1550_handle* h = get_handle(fi);
+	if(h == NULL) {
+		int res = handle_init(&local, path);
+		if(res < 0) {
+			return res;
+		}
+		h = &local;
+	}
+
+	// Writers get the file to themselves
+	pthread_rwlock_wrlock(handle_lock(h));
+
+	// Check if the offset is bigger than our file size
+	if(offset > (off_t) file_size(h)) {
+		pthread_rwlock_unlock(handle_lock(h));
+		return -EFBIG;
+	}
+
+	// The buffer only holds one run of the file, so a write that
+	// doesn't carry on from it (or won't fit) sends it out first.
+	// So does a big write over any of it, or the buffer's older
+	// bytes would land on top of it later.
+	int res = 0;
+	int direct = size >= WRITE_BUFFER_SIZE;
+	struct cs1550_write_buffer* wb = handle_wbuf(h);
+	if(wb != NULL && wb->len > 0 && (offset < wb->start || offset > wb->start + (off_t) wb->len ||
+			offset + size > wb->start + (size_t) WRITE_BUFFER_SIZE ||
+			(direct && offset < wb->start + (off_t) wb->len && offset + (off_t) size > wb->start))) {
+		res = wbuf_flush(h, 0);
+	}
+
+	// Big writes go straight in, as do writes we can't get a buffer for
+	if(res == 0 && (direct || (wb = wbuf_get(h)) == NULL)) {
+		size_t fsize = 0;
+		res = file_write(h, buf, size, offset, &fsize);
+		file_set_size(h, fsize);
+	} else if(res == 0) {
+		// Otherwise gather it up with the writes before it
+		if(wb->len == 0) {
+			wb->start = offset;
+		}
+		memcpy(wb->data + (offset - wb->start), buf, size);
+		if(offset + size > wb->start + wb->len) {
+			wb->len = offset + size - wb->start;
+		}
+		res = size;
+
+		// Send it out once it's full
+		if(wb->len == WRITE_BUFFER_SIZE) {
+			int fres = wbuf_flush(h, 0);
+			if(fres < 0) {
+				res = fres;
+			}
+		}
+	}
+	pthread_rwlock_unlock(handle_lock(h));
+	return res;
+}
+
+/*
+ * truncate is called when a new file is created (with a 0 size) or when an
+ * existing file is opened with O_TRUNC or has its size set. A file that
+ * gets shorter hands the blocks past its new end to the reclaimer, and
+ * one that gets longer is filled out with zeroes.
+ */
 static int cs1550_truncate(const char *path, off_t size)
 {
-	(void) path;
-	(void) size;
+	// The stats file can't be changed, and a file that's been unlinked
+	// can only be reached through a handle
+	if(stats_path(path)) {
+		return -EACCES;
+	} else if(path == NULL) {
+		return -ENOENT;
+	} else if(size < 0) {
+		return -EINVAL;
+	}
+
+	struct cs1550_handle h;
+	int res = handle_init(&h, path);
+	if(res < 0) {
+		return res;
+	}
+
+	// Nothing can be reading or writing the file while its blocks
+	// change, then make sure it's still the same file
+	char dir[MAX_FILENAME + 1];
+	char file_name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];
+	parse_path(path, dir, file_name, ext);
+	pthread_rwlock_wrlock(handle_lock(&h));
+	struct cs1550_file_directory* file = handle_file(&h);
+	if(file == NULL || find_directory(dir) != h.dir || find_file(h.dir, file_name, ext) != h.file) {
+		pthread_rwlock_unlock(handle_lock(&h));
+		return -ENOENT;
+	}
 
-    return 0;
+	// Get everything buffered into the image, so there's only one
+	// place left to cut the file back or fill it out from
+	res = wbuf_flush(&h, 0);
+	if(res == 0 && (size_t) size < file->fsize) {
+		file_cut(file, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		pthread_rwlock_wrlock(dir_lock(h.dir));
+		file->fsize = size;
+		cache_mark_dirty(dir_block(get_directory(h.dir), h.file));
+		pthread_rwlock_unlock(dir_lock(h.dir));
+	}
+
+	// A write never starts past the end, so growing writes zeroes all
+	// the way, and the size goes up as they land in case the disk fills
+	while(res == 0 && file->fsize < (size_t) size) {
+		static const char zeroes[WRITE_BUFFER_SIZE];
+		size_t len = (size_t) size - file->fsize;
+		if(len > sizeof(zeroes)) {
+			len = sizeof(zeroes);
+		}
+		size_t fsize = 0;
+		res = file_write(&h, zeroes, len, file->fsize, &fsize);
+		file_set_size(&h, fsize);
+		if(res >= 0) {
+			res = (size_t) res < len ? -ENOSPC : 0;
+		}
+	}
+
+	// Open handles start their cursors over, and readahead queued for
+	// them is dropped, since the blocks they knew about may be gone
+	struct cs1550_open_file* of = open_file_find(h.dir, h.file);
+	if(of != NULL) {
+		of->gen = __atomic_add_fetch(&open_file_gen, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(handle_lock(&h));
+	return res;
 }
 
 
@@ -1154,14 +4427,43 @@ static int cs1550_truncate(const char *path, off_t size)
  */
 static int cs1550_open(const char *path, struct fuse_file_info *fi)
 {
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+	// The stats file has no handle. Its size changes between
+	// reads, so the kernel can't be trusted to cache any of it.
+	if(stats_path(path)) {
+		fi->direct_io = 1;
+		fi->fh = 0;
+		return 0;
+	}
+
+	// Resolve the file once and keep it in a handle
+	// that read and write get back through fi->fh
+	struct cs1550_handle* h = malloc(sizeof(struct cs1550_handle));
+	if(h == NULL) {
+		return -ENOMEM;
+	}
+
+	//if we can't find the desired file, return an error
+	int res = handle_init(h, path);
+	if(res < 0) {
+		free(h);
+		return res;
+	}
+
+	// Tie it to the file, so unlink and truncate know it's open
+	res = handle_attach(h, path);
+	if(res < 0) {
+		free(h);
+		return res;
+	}
+
+	pthread_mutex_init(&h->lock, NULL);
 
-    //It's not really necessary for this project to anything in open
+	// Chain files get a map of their blocks that grows
+	// as read and write walk further into them
+	if(!cache.extents) {
+		h->cur.map = malloc(16 * sizeof(long));
+		h->cur.map_cap = h->cur.map ? 16 : 0;
+	}
 
     /* We're not going to worry about permissions for this project, but 
 	   if we were and we don't have them to the file we should return an error
@@ -1169,41 +4471,347 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
         return -EACCES;
     */
 
+	// Every change to a file comes in through this mount, and the
+	// kernel drops or updates its cached pages for each write and
+	// truncate it sends us, so what it already has is still good
+	fi->keep_cache = 1;
+
+	fi->fh = (uintptr_t) h;
     return 0; //success!
 }
 
+/*
+ * Called when the last file descriptor for an open file is closed, so
+ * its handle can go.
+ */
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	struct cs1550_handle* h = get_handle(fi);
+	if(h != NULL) {
+		handle_detach(h);
+		pthread_mutex_destroy(&h->lock);
+		free(h->cur.map);
+		free(h);
+		fi->fh = 0;
+	}
+	return 0;
+}
+
 /*
  * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file 
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
+ * have been dup'ed, this isn't a guarantee we won't ever need the file
+ * again. Writes that are still buffered and the blocks they dirtied go
+ * out to .disk here, so close reports any error in getting them there.
  */
 static int cs1550_flush (const char *path , struct fuse_file_info *fi)
 {
-	(void) path;
-	(void) fi;
+	//send the file's buffered writes and the blocks
+	//we've changed out to .disk
+	return flush_file(path, fi);
+}
+
+/*
+ * Called when the user wants a file's contents to be on stable storage.
+ * Everything lives in the one mapping, so this writes back the dirty
+ * blocks of the image.
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) datasync;
+
+	return flush_file(path, fi);
+}
+
+/*
+ * Called once when the filesystem is mounted. This is where we open
+ * .disk and map it so the other operations never have to open it, and
+ * where we tell the kernel how big its reads and writes can be.
+ */
+static void* cs1550_init(struct fuse_conn_info *conn)
+{
+	// The tools mount us with no kernel on the other end
+	if(conn != NULL) {
+		// Writes bigger than a page at a time, as big as fuse's
+		// buffer will take
+		if(conn->capable & FUSE_CAP_BIG_WRITES) {
+			conn->want |= FUSE_CAP_BIG_WRITES;
+		}
+		conn->max_write = MAX_WRITE;
+
+		// max_readahead comes in as the most the kernel will do
+		// and can only be lowered, so it's left as it is
+	}
+
+	int res = disk_open(disk_path);
+	if(res == 0) {
+		io_select();
+		res = cache_load();
+	}
+	if(res == 0) {
+		res = alloc_init();
+	}
+	// The cache is there before the reclaimer starts, which can be
+	// handed blocks to forget as soon as the index is built
+	if(res == 0 && bcache_init(options.cache_mb * 1024 * 1024) < 0) {
+		fprintf(stderr, "cs1550: no memory for a %lu MiB block cache, running without one\n", options.cache_mb);
+	}
+	if(res == 0) {
+		reclaim_start();
+	}
+	if(res == 0) {
+		res = index_build();
+	}
+	readahead_start();
+	if(res < 0) {
+		//every operation will return -EIO from here on
+		fprintf(stderr, "cs1550: unable to map %s: %s\n", disk_path, strerror(-res));
+	}
+	if(options.trace != NULL) {
+		int tres = trace_open(options.trace);
+		if(tres < 0) {
+			fprintf(stderr, "cs1550: unable to trace to %s: %s\n", options.trace, strerror(-tres));
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Called once when the filesystem is unmounted. Sync the image and
+ * give back the mapping.
+ */
+static void cs1550_destroy(void *private_data)
+{
+	(void) private_data;
+
+	// Nothing else should be fetched from here on
+	readahead_stop();
+	trace_close();
+
+	// Send out every file's buffered writes
+	int i = 0;
+	for(i = 0; i < FILE_LOCKS; i++) {
+		while(cache.file_locks[i].wbufs != NULL) {
+			struct cs1550_handle h;
+			h.dir = cache.file_locks[i].wbufs->dir;
+			h.file = cache.file_locks[i].wbufs->file;
+			h.of = NULL;
+			cursor_reset(&h.cur);
+			wbuf_flush(&h, 1);
+		}
+	}
+
+	// Give back whatever removed files and directories still hold
+	reclaim_stop();
+
+	cache_writeback();
+	bcache_drop();
+	io_backend->fini();
+	io_backend = &pread_backend;
+	index_drop();
+	alloc_drop();
+	cache_drop();
+	disk_close();
+}
+
+
+// What fuse actually calls. Each of these counts and times the
+// operation for the stats file, traces it if we're tracing, then
+// hands it on.
+static int timed_getattr(const char *path, struct stat *stbuf)
+{
+	uint64_t start = stats_begin(OP_GETATTR);
+	int res = cs1550_getattr(path, stbuf);
+	uint64_t ns = stats_record(OP_GETATTR, start, res);
+	trace_record(OP_GETATTR, path, 0, 0, 0, start, ns, res);
+	return res;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_begin(OP_READDIR);
+	int res = cs1550_readdir(path, buf, filler, offset, fi);
+	uint64_t ns = stats_record(OP_READDIR, start, res);
+	trace_record(OP_READDIR, path, offset, 0, trace_fh(fi), start, ns, res);
+	return res;
+}
+
+static int timed_mkdir(const char *path, mode_t mode)
+{
+	uint64_t start = stats_begin(OP_MKDIR);
+	int res = cs1550_mkdir(path, mode);
+	uint64_t ns = stats_record(OP_MKDIR, start, res);
+	trace_record(OP_MKDIR, path, 0, mode, 0, start, ns, res);
+	return res;
+}
+
+static int timed_rmdir(const char *path)
+{
+	uint64_t start = stats_begin(OP_RMDIR);
+	int res = cs1550_rmdir(path);
+	uint64_t ns = stats_record(OP_RMDIR, start, res);
+	trace_record(OP_RMDIR, path, 0, 0, 0, start, ns, res);
+	return res;
+}
+
+static int timed_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	uint64_t start = stats_begin(OP_MKNOD);
+	int res = cs1550_mknod(path, mode, dev);
+	uint64_t ns = stats_record(OP_MKNOD, start, res);
+	trace_record(OP_MKNOD, path, 0, mode, 0, start, ns, res);
+	return res;
+}
+
+static int timed_unlink(const char *path)
+{
+	uint64_t start = stats_begin(OP_UNLINK);
+	int res = cs1550_unlink(path);
+	uint64_t ns = stats_record(OP_UNLINK, start, res);
+	trace_record(OP_UNLINK, path, 0, 0, 0, start, ns, res);
+	return res;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	uint64_t start = stats_begin(OP_READ);
+	int res = cs1550_read(path, buf, size, offset, fi);
+	uint64_t ns = stats_record(OP_READ, start, res);
+	trace_record(OP_READ, path, offset, size, trace_fh(fi), start, ns, res);
+	return res;
+}
+
+static int timed_write(const char *path, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_begin(OP_WRITE);
+	int res = cs1550_write(path, buf, size, offset, fi);
+	uint64_t ns = stats_record(OP_WRITE, start, res);
+	trace_record(OP_WRITE, path, offset, size, trace_fh(fi), start, ns, res);
+	return res;
+}
+
+static int timed_truncate(const char *path, off_t size)
+{
+	uint64_t start = stats_begin(OP_TRUNCATE);
+	int res = cs1550_truncate(path, size);
+	uint64_t ns = stats_record(OP_TRUNCATE, start, res);
+	trace_record(OP_TRUNCATE, path, size, 0, 0, start, ns, res);
+	return res;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_begin(OP_OPEN);
+	int res = cs1550_open(path, fi);
+	uint64_t ns = stats_record(OP_OPEN, start, res);
+	trace_record(OP_OPEN, path, 0, fi->flags, fi->fh, start, ns, res);
+	return res;
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+	//release clears the handle, so remember which one it was
+	uint64_t fh = trace_fh(fi);
+	uint64_t start = stats_begin(OP_RELEASE);
+	int res = cs1550_release(path, fi);
+	uint64_t ns = stats_record(OP_RELEASE, start, res);
+	trace_record(OP_RELEASE, path, 0, 0, fh, start, ns, res);
+	return res;
+}
 
-	return 0; //success!
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_begin(OP_FLUSH);
+	int res = cs1550_flush(path, fi);
+	uint64_t ns = stats_record(OP_FLUSH, start, res);
+	trace_record(OP_FLUSH, path, 0, 0, trace_fh(fi), start, ns, res);
+	return res;
 }
 
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	uint64_t start = stats_begin(OP_FSYNC);
+	int res = cs1550_fsync(path, datasync, fi);
+	uint64_t ns = stats_record(OP_FSYNC, start, res);
+	trace_record(OP_FSYNC, path, 0, datasync, trace_fh(fi), start, ns, res);
+	return res;
+}
 
 //register our new functions as the implementations of the syscalls
 static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-	.rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-	.mknod	= cs1550_mknod,
-	.unlink = cs1550_unlink,
-	.truncate = cs1550_truncate,
-	.flush = cs1550_flush,
-	.open	= cs1550_open,
+    .getattr	= timed_getattr,
+    .readdir	= timed_readdir,
+    .mkdir	= timed_mkdir,
+	.rmdir = timed_rmdir,
+    .read	= timed_read,
+    .write	= timed_write,
+	.mknod	= timed_mknod,
+	.unlink = timed_unlink,
+	.truncate = timed_truncate,
+	.flush = timed_flush,
+	.fsync = timed_fsync,
+	.open	= timed_open,
+	.release = timed_release,
+	.init	= cs1550_init,
+	.destroy = cs1550_destroy,
+	// An unlinked file that's still open has no path, but its
+	// handle is all read, write, flush and release need
+	.flag_nullpath_ok = 1,
+};
+
+//the tools that build on this file bring their own main
+#ifndef CS1550_NO_MAIN
+//the options we understand after -o, anything else goes to fuse
+static struct fuse_opt cs1550_opts[] = {
+	{ "cache_mb=%lu", offsetof(struct cs1550_options, cache_mb), 0 },
+	{ "io=%s", offsetof(struct cs1550_options, io), 0 },
+	{ "block_size=%lu", offsetof(struct cs1550_options, block_size), 0 },
+	{ "trace=%s", offsetof(struct cs1550_options, trace), 0 },
+	FUSE_OPT_END
 };
 
-//Don't change this.
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	//remember where .disk is before fuse changes our directory
+	if(realpath(".disk", disk_path) == NULL) {
+		strcpy(disk_path, ".disk");
+	}
+
+	//pull our own mount options out before fuse sees them
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) < 0) {
+		return 1;
+	}
+
+	//let the kernel hold on to names, attributes and misses for a
+	//while, since nothing but this mount changes the image. These go
+	//first so the same options given on the command line win.
+	if(fuse_opt_insert_arg(&args, 1, "-o" CACHE_TIMEOUTS) < 0) {
+		return 1;
+	}
+
+	//unlink a file that's open for real instead of having fuse try to
+	//rename it out of the way, which we can't do. Its handles keep
+	//working until they're released.
+	if(fuse_opt_insert_arg(&args, 1, "-ohard_remove") < 0) {
+		return 1;
+	}
+
+	//the trace has to be found from / too
+	static char trace_path[PATH_MAX];
+	if(options.trace != NULL && options.trace[0] != '/' && getcwd(trace_path, sizeof(trace_path)) != NULL &&
+			strlen(trace_path) + strlen(options.trace) + 2 <= sizeof(trace_path)) {
+		strcat(trace_path, "/");
+		strcat(trace_path, options.trace);
+		options.trace = trace_path;
+	}
+
+	int res = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }
+#endif
@@ -0,0 +1,510 @@
+/*
+	cs1550_bench: time the filesystem's operations without mounting it
+
+	The cs1550_* callbacks are called directly against a scratch image,
+	the same way fuse would call them, so the numbers are the cost of
+	the filesystem itself with no kernel round trips in them. Each
+	workload prints one line of JSON to stdout with its throughput and
+	latency percentiles, so runs can be kept and compared.
+
+	usage: cs1550_bench [-b block_size] [-s image_size] [-f file_size]
+	                    [-n ops] [-c cache_mb] [-i uring|pread]
+	                    [-r seed] [-d dir] [-k]
+*/
+
+// Everything but main comes from the filesystem itself
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+#include <time.h>
+
+// What to run, filled in from the command line
+struct bench_config {
+	long long image_size;	//bytes in the scratch image
+	long block_size;		//block size it gets formatted with
+	long long file_size;	//bytes in each file the data workloads use
+	long ops;				//operations in each random and metadata workload
+	unsigned int seed;		//for the random offsets
+	const char* dir;		//where the scratch image goes
+	int keep;				//leave the image behind afterwards
+};
+
+static struct bench_config config = { 1LL << 30, 4096, 64LL << 20, 10000, 1, NULL, 0 };
+
+// The timings of one workload
+struct bench_result {
+	const char* name;
+	long ops;			//operations timed
+	long long bytes;	//bytes read or written, 0 for metadata
+	uint64_t ns;		//wall time for all of them
+	uint64_t* lat;		//latency of each operation in ns
+	struct cs1550_io_stats io;	//the filesystem's I/O counters when it started
+};
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_fail(const char* what, const char* path, int res) {
+	fprintf(stderr, "cs1550_bench: %s %s: %s\n", what, path, strerror(res < 0 ? -res : EIO));
+	exit(1);
+}
+
+static void result_start(struct bench_result* r, const char* name, long ops) {
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->lat = malloc((ops > 0 ? ops : 1) * sizeof(uint64_t));
+	if(r->lat == NULL) {
+		bench_fail("allocating", "latencies", -ENOMEM);
+	}
+	io_stats_get(-1, &r->io);
+	r->ns = now_ns();
+}
+
+// Time one operation that started at start
+static void result_add(struct bench_result* r, uint64_t start, long long bytes) {
+	r->lat[r->ops++] = now_ns() - start;
+	r->bytes += bytes;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+// Stop the clock and print the workload as one line of JSON
+static void result_end(struct bench_result* r) {
+	r->ns = now_ns() - r->ns;
+	double secs = r->ns / 1e9;
+
+	// What it took from .disk to do it
+	struct cs1550_io_stats io;
+	io_stats_get(-1, &io);
+	unsigned long physical_read = io.physical_read - r->io.physical_read;
+	unsigned long physical_written = io.physical_written - r->io.physical_written;
+	unsigned long requests = io.requests - r->io.requests;
+	char amplification[32] = "null";
+	if(r->bytes > 0) {
+		snprintf(amplification, sizeof(amplification), "%.3f",
+				(double) (physical_read + physical_written) / r->bytes);
+	}
+
+	uint64_t p50 = 0, p99 = 0, max = 0;
+	if(r->ops > 0) {
+		qsort(r->lat, r->ops, sizeof(uint64_t), cmp_u64);
+		p50 = r->lat[(r->ops - 1) * 50 / 100];
+		p99 = r->lat[(r->ops - 1) * 99 / 100];
+		max = r->lat[r->ops - 1];
+	}
+
+	printf("{\"workload\":\"%s\",\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+			"\"bytes\":%lld,\"mib_per_sec\":%.2f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,"
+			"\"disk_read_bytes\":%lu,\"disk_written_bytes\":%lu,\"disk_requests\":%lu,\"amplification\":%s}\n",
+			r->name, r->ops, secs, secs > 0 ? r->ops / secs : 0.0,
+			r->bytes, secs > 0 ? r->bytes / secs / (1024 * 1024) : 0.0,
+			p50 / 1e3, p99 / 1e3, max / 1e3,
+			physical_read, physical_written, requests, amplification);
+	fflush(stdout);
+	free(r->lat);
+}
+
+// What byte off of a file holds after it was last written in
+// generation gen. Every byte depends on where it is, so data that
+// lands in the wrong place or comes back stale doesn't match.
+static char pattern(off_t off, unsigned char gen) {
+	return (char) ((off * 31) ^ (off >> 12) ^ (gen * 101));
+}
+
+static void pattern_fill(char* buf, size_t size, off_t off, unsigned char gen) {
+	size_t i = 0;
+	for(i = 0; i < size; i++) {
+		buf[i] = pattern(off + i, gen);
+	}
+}
+
+// A read that came back fast but wrong isn't a speedup
+static void pattern_check(const char* path, const char* buf, size_t size, off_t off, unsigned char gen) {
+	size_t i = 0;
+	for(i = 0; i < size; i++) {
+		if(buf[i] != pattern(off + i, gen)) {
+			fprintf(stderr, "cs1550_bench: %s: wrong data at byte %lld\n", path, (long long) (off + i));
+			exit(1);
+		}
+	}
+}
+
+// Unmount and mount again so the next workload starts with
+// nothing of the last one in the block cache
+static void remount() {
+	cs1550_destroy(NULL);
+	cs1550_init(NULL);
+	if(disk.map == NULL) {
+		bench_fail("mounting", disk_path, -EIO);
+	}
+}
+
+static void bench_open(const char* path, struct fuse_file_info* fi) {
+	memset(fi, 0, sizeof(*fi));
+	int res = cs1550_open(path, fi);
+	if(res < 0) {
+		bench_fail("opening", path, res);
+	}
+}
+
+// What close does: flush, then release
+static void bench_close(const char* path, struct fuse_file_info* fi) {
+	int res = cs1550_flush(path, fi);
+	if(res < 0) {
+		bench_fail("flushing", path, res);
+	}
+	cs1550_release(path, fi);
+}
+
+static void bench_create(const char* path) {
+	int res = cs1550_mknod(path, S_IFREG | 0644, 0);
+	if(res < 0) {
+		bench_fail("creating", path, res);
+	}
+}
+
+// Names of the directories and files the metadata storm makes
+static void dir_name(char* path, long d) {
+	sprintf(path, "/d%05ld", d);
+}
+
+static void file_name(char* path, long d, long f) {
+	sprintf(path, "/d%05ld/f%06ld.dat", d, f);
+}
+
+// Count what a listing hands back, the way ls -l would use it
+static int bench_filler(void* buf, const char* name, const struct stat* st, off_t off) {
+	(void) name;
+	(void) off;
+	*(long*) buf += st != NULL ? 1 : 0;
+	return 0;
+}
+
+// Make directories, fill them with files, then look the files up,
+// look up names that aren't there and list every directory
+static void bench_metadata() {
+	char path[64];
+	struct stat st;
+
+	// A root that can grow gets a directory for every 16 files. On
+	// an original image one root slot stays free for the data workloads.
+	long dirs = cache.dir_chains ? config.ops / 16 : MAX_DIRS_IN_ROOT - 1;
+	if(dirs < 1) {
+		dirs = 1;
+	}
+	if(dirs > config.ops) {
+		dirs = config.ops;
+	}
+	struct bench_result r;
+	result_start(&r, "mkdir", dirs);
+	long d = 0;
+	for(d = 0; d < dirs; d++) {
+		dir_name(path, d);
+		uint64_t t = now_ns();
+		int res = cs1550_mkdir(path, 0755);
+		if(res < 0) {
+			bench_fail("mkdir", path, res);
+		}
+		result_add(&r, t, 0);
+	}
+	result_end(&r);
+
+	// Spread the files over the directories round robin. Only an
+	// original image has directories that can't grow.
+	long files = config.ops;
+	if(!cache.dir_chains && files > dirs * MAX_FILES_IN_DIR) {
+		files = dirs * MAX_FILES_IN_DIR;
+	}
+	result_start(&r, "mknod", files);
+	long i = 0;
+	for(i = 0; i < files; i++) {
+		file_name(path, i % dirs, i / dirs);
+		uint64_t t = now_ns();
+		int res = cs1550_mknod(path, S_IFREG | 0644, 0);
+		if(res < 0) {
+			bench_fail("mknod", path, res);
+		}
+		result_add(&r, t, 0);
+	}
+	result_end(&r);
+
+	result_start(&r, "getattr", config.ops);
+	for(i = 0; i < config.ops; i++) {
+		long n = rand() % files;
+		file_name(path, n % dirs, n / dirs);
+		uint64_t t = now_ns();
+		int res = cs1550_getattr(path, &st);
+		if(res < 0) {
+			bench_fail("getattr", path, res);
+		}
+		result_add(&r, t, 0);
+	}
+	result_end(&r);
+
+	// Names past the last file in each directory, the way a
+	// shell looking for a command or a build probing for headers
+	// misses over and over
+	result_start(&r, "getattr_miss", config.ops);
+	for(i = 0; i < config.ops; i++) {
+		file_name(path, rand() % dirs, (files + dirs - 1) / dirs + rand() % 1000);
+		uint64_t t = now_ns();
+		int res = cs1550_getattr(path, &st);
+		if(res != -ENOENT) {
+			bench_fail("getattr_miss", path, res < 0 ? res : -EEXIST);
+		}
+		result_add(&r, t, 0);
+	}
+	result_end(&r);
+
+	// Every entry comes back with its attributes, so this is all
+	// an ls -l of each directory costs
+	result_start(&r, "readdir", dirs);
+	long listed = 0;
+	for(d = 0; d < dirs; d++) {
+		dir_name(path, d);
+		uint64_t t = now_ns();
+		int res = cs1550_readdir(path, &listed, bench_filler, 0, NULL);
+		if(res < 0) {
+			bench_fail("readdir", path, res);
+		}
+		result_add(&r, t, 0);
+	}
+	result_end(&r);
+	if(listed != files + 2 * dirs) {
+		bench_fail("readdir", "/", -EIO);
+	}
+}
+
+// Write a whole file front to back in chunks of size bytes
+static void bench_seq_write(const char* name, const char* path, size_t size, char* buf, unsigned char* gen) {
+	struct fuse_file_info fi;
+	long ops = config.file_size / size;
+	bench_create(path);
+	bench_open(path, &fi);
+
+	struct bench_result r;
+	result_start(&r, name, ops);
+	long i = 0;
+	for(i = 0; i < ops; i++) {
+		gen[i] = 1;
+		pattern_fill(buf, size, (off_t) i * size, gen[i]);
+		uint64_t t = now_ns();
+		int res = cs1550_write(path, buf, size, (off_t) i * size, &fi);
+		if(res != (int) size) {
+			bench_fail("write", path, res);
+		}
+		result_add(&r, t, size);
+	}
+	// Getting it to the image is part of the cost
+	bench_close(path, &fi);
+	result_end(&r);
+}
+
+// Read a whole file front to back in chunks of size bytes
+static void bench_seq_read(const char* name, const char* path, size_t size, char* buf, const unsigned char* gen) {
+	struct fuse_file_info fi;
+	long ops = config.file_size / size;
+	bench_open(path, &fi);
+
+	struct bench_result r;
+	result_start(&r, name, ops);
+	long i = 0;
+	for(i = 0; i < ops; i++) {
+		uint64_t t = now_ns();
+		int res = cs1550_read(path, buf, size, (off_t) i * size, &fi);
+		if(res != (int) size) {
+			bench_fail("read", path, res);
+		}
+		result_add(&r, t, size);
+		pattern_check(path, buf, size, (off_t) i * size, gen[i]);
+	}
+	bench_close(path, &fi);
+	result_end(&r);
+}
+
+// Read or overwrite chunks of size bytes at random aligned offsets.
+// Each overwrite moves its chunk to the next generation, so a read
+// that still sees the old contents doesn't pass.
+static void bench_random(const char* name, const char* path, size_t size, char* buf, unsigned char* gen, int write) {
+	struct fuse_file_info fi;
+	long chunks = config.file_size / size;
+	bench_open(path, &fi);
+
+	struct bench_result r;
+	result_start(&r, name, config.ops);
+	long i = 0;
+	for(i = 0; i < config.ops; i++) {
+		long chunk = rand() % chunks;
+		off_t offset = (off_t) chunk * size;
+		if(write) {
+			gen[chunk]++;
+			pattern_fill(buf, size, offset, gen[chunk]);
+		}
+		uint64_t t = now_ns();
+		int res = write ? cs1550_write(path, buf, size, offset, &fi)
+				: cs1550_read(path, buf, size, offset, &fi);
+		if(res != (int) size) {
+			bench_fail(write ? "write" : "read", path, res);
+		}
+		result_add(&r, t, size);
+		if(!write) {
+			pattern_check(path, buf, size, offset, gen[chunk]);
+		}
+	}
+	bench_close(path, &fi);
+	result_end(&r);
+}
+
+// Read a whole file back, untimed, to check that the overwrites of
+// a random write workload all landed where they should
+static void bench_verify(const char* path, size_t size, char* buf, const unsigned char* gen) {
+	struct fuse_file_info fi;
+	long chunks = config.file_size / size;
+	bench_open(path, &fi);
+	long i = 0;
+	for(i = 0; i < chunks; i++) {
+		int res = cs1550_read(path, buf, size, (off_t) i * size, &fi);
+		if(res != (int) size) {
+			bench_fail("read", path, res);
+		}
+		pattern_check(path, buf, size, (off_t) i * size, gen[i]);
+	}
+	bench_close(path, &fi);
+}
+
+// Open, write to the end and close over and over, the way a log
+// gets written with >>
+static void bench_append(const char* name, const char* path, size_t size, char* buf) {
+	struct fuse_file_info fi;
+	bench_create(path);
+
+	struct bench_result r;
+	result_start(&r, name, config.ops);
+	long i = 0;
+	for(i = 0; i < config.ops; i++) {
+		pattern_fill(buf, size, (off_t) i * size, 1);
+		uint64_t t = now_ns();
+		bench_open(path, &fi);
+		int res = cs1550_write(path, buf, size, (off_t) i * size, &fi);
+		if(res != (int) size) {
+			bench_fail("write", path, res);
+		}
+		bench_close(path, &fi);
+		result_add(&r, t, size);
+	}
+	result_end(&r);
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-b block_size] [-s image_size] [-f file_size] [-n ops]\n"
+			"       [-c cache_mb] [-i uring|pread] [-r seed] [-d dir] [-k]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+	int c = 0;
+	while((c = getopt(argc, argv, "b:s:f:n:c:i:r:d:k")) != -1) {
+		switch(c) {
+			case 'b': config.block_size = atol(optarg); break;
+			case 's': config.image_size = atoll(optarg) << 20; break;
+			case 'f': config.file_size = atoll(optarg) << 20; break;
+			case 'n': config.ops = atol(optarg); break;
+			case 'c': options.cache_mb = strtoul(optarg, NULL, 10); break;
+			case 'i': options.io = optarg; break;
+			case 'r': config.seed = strtoul(optarg, NULL, 10); break;
+			case 'd': config.dir = optarg; break;
+			case 'k': config.keep = 1; break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if(config.ops <= 0 || config.file_size < 128 * 1024 || config.image_size < 4 * config.file_size) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	// A blank scratch image, formatted by the mount
+	const char* dir = config.dir;
+	if(dir == NULL) {
+		dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	}
+	snprintf(disk_path, sizeof(disk_path), "%s/cs1550-bench-XXXXXX", dir);
+	int fd = mkstemp(disk_path);
+	if(fd < 0 || ftruncate(fd, config.image_size) < 0) {
+		bench_fail("creating", disk_path, -errno);
+	}
+	close(fd);
+	options.block_size = config.block_size;
+	srand(config.seed);
+
+	cs1550_init(NULL);
+	if(disk.map == NULL) {
+		bench_fail("mounting", disk_path, -EIO);
+	}
+
+	printf("{\"config\":{\"block_size\":%ld,\"image_mib\":%lld,\"file_mib\":%lld,\"ops\":%ld,"
+			"\"cache_mb\":%lu,\"io\":\"%s\",\"seed\":%u}}\n",
+			(long) BLOCK_SIZE, config.image_size >> 20, config.file_size >> 20, config.ops,
+			options.cache_mb, io_backend->name, config.seed);
+
+	bench_metadata();
+
+	// The data workloads get a directory of their own
+	int res = cs1550_mkdir("/data", 0755);
+	if(res < 0) {
+		bench_fail("mkdir", "/data", res);
+	}
+	char* buf = malloc(128 * 1024);
+	if(buf == NULL) {
+		bench_fail("allocating", "buffer", -ENOMEM);
+	}
+	// The generation each 4k chunk of a file was last written in
+	unsigned char* gen = malloc(config.file_size / 4096);
+	if(gen == NULL) {
+		bench_fail("allocating", "generations", -ENOMEM);
+	}
+
+	remount();
+	bench_seq_write("seq_write_4k", "/data/seq4k.dat", 4096, buf, gen);
+	remount();
+	bench_seq_read("seq_read_4k", "/data/seq4k.dat", 4096, buf, gen);
+	remount();
+	bench_random("rand_read_4k", "/data/seq4k.dat", 4096, buf, gen, 0);
+	remount();
+	bench_random("rand_write_4k", "/data/seq4k.dat", 4096, buf, gen, 1);
+	remount();
+	bench_verify("/data/seq4k.dat", 4096, buf, gen);
+
+	// The 128k workloads only ever touch whole 128k chunks
+	remount();
+	bench_seq_write("seq_write_128k", "/data/seq128k.dat", 128 * 1024, buf, gen);
+	remount();
+	bench_seq_read("seq_read_128k", "/data/seq128k.dat", 128 * 1024, buf, gen);
+	remount();
+	bench_random("rand_read_128k", "/data/seq128k.dat", 128 * 1024, buf, gen, 0);
+	remount();
+	bench_random("rand_write_128k", "/data/seq128k.dat", 128 * 1024, buf, gen, 1);
+	remount();
+	bench_verify("/data/seq128k.dat", 128 * 1024, buf, gen);
+
+	remount();
+	bench_append("append_4k", "/data/append.dat", 4096, buf);
+
+	free(gen);
+	free(buf);
+	cs1550_destroy(NULL);
+	if(!config.keep) {
+		unlink(disk_path);
+	}
+
+	// The operations are only there for the mount
+	(void) hello_oper;
+	return 0;
+}
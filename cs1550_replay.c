@@ -0,0 +1,269 @@
+/*
+	cs1550_replay: play a trace back against a fresh image
+
+	Reads a trace made by mounting with -o trace=FILE and makes the same
+	calls, in the same order, through hello_oper against a new scratch
+	image, so a workload seen on a live mount can be profiled offline.
+	By default the calls go as fast as they can; with -t each one waits
+	until as long after the start as it came in the trace. Calls are
+	made one at a time, even if the mount ran them side by side. Written
+	data is a fixed pattern, since the trace only has the sizes.
+
+	At the end it prints one line of JSON: how many calls were made,
+	how many returned something other than they did in the trace, and
+	how long it took. -v adds what the stats file would show.
+
+	usage: cs1550_replay [-t] [-v] [-b block_size] [-s image_size]
+	                     [-c cache_mb] [-i uring|pread] [-d dir] [-k] trace
+*/
+
+// Everything but main comes from the filesystem itself
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+// How to play it back, filled in from the command line
+struct replay_config {
+	int timed;				//keep to the trace's timing
+	int verbose;			//print the stats at the end
+	long block_size;		//block size the image gets formatted with
+	long long image_size;	//bytes in the scratch image
+	const char* dir;		//where the scratch image goes
+	int keep;				//leave the image behind afterwards
+};
+
+static struct replay_config config = { 0, 0, 4096, 1LL << 30, NULL, 0 };
+
+// The files the trace has open, by the handle they had in the trace
+struct replay_handle {
+	uint64_t fh;
+	struct fuse_file_info fi;
+};
+
+static struct replay_handle* handles = NULL;
+static int nHandles = 0;
+static int capHandles = 0;
+
+static struct fuse_file_info* replay_find(uint64_t fh) {
+	int i = 0;
+	for(i = 0; fh != 0 && i < nHandles; i++) {
+		if(handles[i].fh == fh) {
+			return &handles[i].fi;
+		}
+	}
+	return NULL;
+}
+
+static int replay_add(uint64_t fh, struct fuse_file_info* fi) {
+	if(nHandles == capHandles) {
+		int cap = capHandles > 0 ? capHandles * 2 : 64;
+		struct replay_handle* grown = realloc(handles, cap * sizeof(struct replay_handle));
+		if(grown == NULL) {
+			return -ENOMEM;
+		}
+		handles = grown;
+		capHandles = cap;
+	}
+	handles[nHandles].fh = fh;
+	handles[nHandles].fi = *fi;
+	nHandles++;
+	return 0;
+}
+
+static void replay_remove(uint64_t fh) {
+	int i = 0;
+	for(i = 0; i < nHandles; i++) {
+		if(handles[i].fh == fh) {
+			handles[i] = handles[--nHandles];
+			return;
+		}
+	}
+}
+
+// readdir's listing isn't needed, only the work of making it
+static int replay_filler(void* buf, const char* name, const struct stat* stbuf, off_t off) {
+	(void) buf;
+	(void) name;
+	(void) stbuf;
+	(void) off;
+	return 0;
+}
+
+// Make the call in r again, with buf big enough for its data
+static int replay_call(struct cs1550_trace_record* r, const char* path, char* buf) {
+	struct fuse_file_info* fi = replay_find(r->fh);
+	struct fuse_file_info opened;
+	struct stat st;
+	int res = 0;
+
+	switch(r->op) {
+		case OP_GETATTR:
+			return hello_oper.getattr(path, &st);
+		case OP_READDIR:
+			return hello_oper.readdir(path, NULL, replay_filler, r->offset, fi);
+		case OP_MKDIR:
+			return hello_oper.mkdir(path, r->size);
+		case OP_RMDIR:
+			return hello_oper.rmdir(path);
+		case OP_MKNOD:
+			return hello_oper.mknod(path, r->size, 0);
+		case OP_UNLINK:
+			return hello_oper.unlink(path);
+		case OP_READ:
+			return hello_oper.read(path, buf, r->size, r->offset, fi);
+		case OP_WRITE:
+			return hello_oper.write(path, buf, r->size, r->offset, fi);
+		case OP_TRUNCATE:
+			return hello_oper.truncate(path, r->offset);
+		case OP_OPEN:
+			memset(&opened, 0, sizeof(opened));
+			opened.flags = r->size;
+			res = hello_oper.open(path, &opened);
+			if(res == 0 && (r->fh == 0 || replay_add(r->fh, &opened) < 0)) {
+				//nothing in the trace will use it
+				hello_oper.release(path, &opened);
+			}
+			return res;
+		case OP_RELEASE:
+			res = hello_oper.release(path, fi);
+			replay_remove(r->fh);
+			return res;
+		case OP_FLUSH:
+			return hello_oper.flush(path, fi);
+		case OP_FSYNC:
+			return hello_oper.fsync(path, r->size, fi);
+	}
+	return -ENOSYS;
+}
+
+static void replay_fail(const char* what, const char* path, int err) {
+	fprintf(stderr, "cs1550_replay: %s %s: %s\n", what, path, strerror(err));
+	exit(1);
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-t] [-v] [-b block_size] [-s image_size] [-c cache_mb]\n"
+			"       [-i uring|pread] [-d dir] [-k] trace\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+	int c = 0;
+	while((c = getopt(argc, argv, "tvb:s:c:i:d:k")) != -1) {
+		switch(c) {
+			case 't': config.timed = 1; break;
+			case 'v': config.verbose = 1; break;
+			case 'b': config.block_size = atol(optarg); break;
+			case 's': config.image_size = atoll(optarg) << 20; break;
+			case 'c': options.cache_mb = strtoul(optarg, NULL, 10); break;
+			case 'i': options.io = optarg; break;
+			case 'd': config.dir = optarg; break;
+			case 'k': config.keep = 1; break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if(optind != argc - 1 || config.image_size <= 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	const char* trace_path = argv[optind];
+
+	FILE* in = fopen(trace_path, "rb");
+	if(in == NULL) {
+		replay_fail("opening", trace_path, errno);
+	}
+	struct cs1550_trace_header header;
+	if(fread(&header, sizeof(header), 1, in) != 1 ||
+			memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+			header.version != TRACE_VERSION) {
+		replay_fail("reading", trace_path, EINVAL);
+	}
+
+	// A blank scratch image, formatted by the mount
+	const char* dir = config.dir;
+	if(dir == NULL) {
+		dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	}
+	snprintf(disk_path, sizeof(disk_path), "%s/cs1550-replay-XXXXXX", dir);
+	int fd = mkstemp(disk_path);
+	if(fd < 0 || ftruncate(fd, config.image_size) < 0) {
+		replay_fail("creating", disk_path, errno);
+	}
+	close(fd);
+	options.block_size = config.block_size;
+
+	hello_oper.init(NULL);
+	if(disk.map == NULL) {
+		replay_fail("mounting", disk_path, EIO);
+	}
+
+	// Reads and writes share one buffer, as big as the biggest yet
+	char* buf = NULL;
+	size_t buf_size = 0;
+	char path[PATH_MAX + 1];
+
+	unsigned long calls = 0, diverged = 0;
+	uint64_t traced = 0;
+	uint64_t epoch = stats_now();
+	struct cs1550_trace_record r;
+	while(fread(&r, sizeof(r), 1, in) == 1) {
+		if(r.path_len > PATH_MAX || fread(path, 1, r.path_len, in) != r.path_len) {
+			replay_fail("reading", trace_path, EINVAL);
+		}
+		path[r.path_len] = '\0';
+
+		if((r.op == OP_READ || r.op == OP_WRITE) && r.size > buf_size) {
+			char* grown = realloc(buf, r.size);
+			if(grown == NULL) {
+				replay_fail("allocating", "buffer", ENOMEM);
+			}
+			memset(grown + buf_size, 0xa5, r.size - buf_size);
+			buf = grown;
+			buf_size = r.size;
+		}
+
+		// Wait until it's time for this one
+		if(config.timed) {
+			uint64_t now = stats_now() - epoch;
+			if(r.start > now) {
+				struct timespec ts = { (r.start - now) / 1000000000ULL, (r.start - now) % 1000000000ULL };
+				while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+			}
+		}
+
+		int res = replay_call(&r, path, buf);
+		calls++;
+		if(res != r.result) {
+			diverged++;
+		}
+		if(r.start + r.latency > traced) {
+			traced = r.start + r.latency;
+		}
+	}
+	double secs = (stats_now() - epoch) / 1e9;
+	fclose(in);
+
+	// Anything the trace left open gets closed
+	while(nHandles > 0) {
+		hello_oper.release("", &handles[nHandles - 1].fi);
+		nHandles--;
+	}
+	free(handles);
+	free(buf);
+
+	printf("{\"calls\":%lu,\"diverged\":%lu,\"seconds\":%.6f,\"calls_per_sec\":%.1f,\"trace_seconds\":%.6f}\n",
+			calls, diverged, secs, secs > 0 ? calls / secs : 0.0, traced / 1e9);
+	if(config.verbose) {
+		char stats[STATS_SIZE];
+		stats_render(stats);
+		fputs(stats, stdout);
+	}
+
+	hello_oper.destroy(NULL);
+	if(!config.keep) {
+		unlink(disk_path);
+	} else {
+		fprintf(stderr, "cs1550_replay: the image is in %s\n", disk_path);
+	}
+	return 0;
+}
@@ -0,0 +1,1187 @@
+/*
+	cs1550_test: regression tests for the filesystem
+
+	Each test gets a blank scratch image of its own, mounted the way
+	the tools mount it, and calls the cs1550_* callbacks directly.
+	Data written is a pattern that depends on where it lands in the
+	file, so reading back anything from the wrong place or the wrong
+	time shows up. One line is printed per test, and the exit status
+	is 1 if any of them failed.
+
+	usage: cs1550_test [-d dir] [test ...]
+*/
+
+// Everything but main comes from the filesystem itself, and from the
+// upgrade mkfs.cs1550 -u does
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+#include "cs1550_upgrade.c"
+
+// Where the scratch images go
+static const char* test_dir = NULL;
+
+// Fail the running test with where and why, and give up on it
+#define CHECK(cond) do { \
+		if(!(cond)) { \
+			fprintf(stderr, "cs1550_test: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			return -1; \
+		} \
+	} while(0)
+
+// The byte of a file at offset off written with seed
+static char pattern(long long off, int seed) {
+	return (char) ((off * 31 + (off >> 12) + seed) & 0xff);
+}
+
+static void pattern_fill(char* buf, size_t size, long long off, int seed) {
+	size_t i = 0;
+	for(i = 0; i < size; i++) {
+		buf[i] = pattern(off + i, seed);
+	}
+}
+
+// Where the bytes at off first differ from the pattern, or -1
+static long long pattern_check(const char* buf, size_t size, long long off, int seed) {
+	size_t i = 0;
+	for(i = 0; i < size; i++) {
+		if(buf[i] != pattern(off + i, seed)) {
+			return off + i;
+		}
+	}
+	return -1;
+}
+
+// Make a blank image of size bytes in disk_path
+static int test_image(long long size) {
+	const char* dir = test_dir;
+	if(dir == NULL) {
+		dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	}
+	snprintf(disk_path, sizeof(disk_path), "%s/cs1550-test-XXXXXX", dir);
+	int fd = mkstemp(disk_path);
+	if(fd < 0) {
+		return -errno;
+	}
+	if(ftruncate(fd, size) < 0) {
+		int err = -errno;
+		close(fd);
+		unlink(disk_path);
+		return err;
+	}
+	close(fd);
+	return 0;
+}
+
+// Make a blank image of size bytes and mount it with blocks of
+// block_size bytes
+static int test_mount(long long size, long block_size) {
+	int res = test_image(size);
+	if(res < 0) {
+		return res;
+	}
+	options.block_size = block_size;
+	cs1550_init(NULL);
+	if(disk.map == NULL) {
+		unlink(disk_path);
+		return -EIO;
+	}
+	return 0;
+}
+
+// Unmount and mount the same image again, so nothing is left in memory
+static int test_remount() {
+	cs1550_destroy(NULL);
+	cs1550_init(NULL);
+	return disk.map != NULL ? 0 : -EIO;
+}
+
+// Unmount and throw the image away
+static void test_unmount() {
+	if(disk.map != NULL) {
+		cs1550_destroy(NULL);
+	}
+	unlink(disk_path);
+}
+
+// Read size bytes at off from path through a fresh handle
+static int test_read(const char* path, char* buf, size_t size, off_t off) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	int res = cs1550_open(path, &fi);
+	if(res < 0) {
+		return res;
+	}
+	res = cs1550_read(path, buf, size, off, &fi);
+	cs1550_release(path, &fi);
+	return res;
+}
+
+// A big write over bytes still sitting in the write buffer has to win
+// over them, both before the buffer goes out and after
+static int test_write_overlap() {
+	const char* path = "/d/f.bin";
+	static char buf[WRITE_BUFFER_SIZE];
+	size_t big = sizeof(buf);
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	CHECK(cs1550_mknod(path, S_IFREG | 0644, 0) == 0);
+
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	CHECK(cs1550_open(path, &fi) == 0);
+
+	// A small write that stays in the buffer, then a big one over it
+	pattern_fill(buf, 4096, 0, 1);
+	CHECK(cs1550_write(path, buf, 4096, 0, &fi) == 4096);
+	pattern_fill(buf, big, 0, 2);
+	CHECK(cs1550_write(path, buf, big, 0, &fi) == (int) big);
+
+	memset(buf, 0, big);
+	CHECK(cs1550_read(path, buf, big, 0, &fi) == (int) big);
+	CHECK(pattern_check(buf, big, 0, 2) < 0);
+
+	// A big write that ends partway into the buffer
+	pattern_fill(buf, 4096, big, 3);
+	CHECK(cs1550_write(path, buf, 4096, big, &fi) == 4096);
+	pattern_fill(buf, big, 4096, 4);
+	CHECK(cs1550_write(path, buf, big, 4096, &fi) == (int) big);
+
+	CHECK(cs1550_flush(path, &fi) == 0);
+	cs1550_release(path, &fi);
+	CHECK(test_remount() == 0);
+
+	memset(buf, 0, big);
+	CHECK(test_read(path, buf, 4096, 0) == 4096);
+	CHECK(pattern_check(buf, 4096, 0, 2) < 0);
+	CHECK(test_read(path, buf, big, 4096) == (int) big);
+	CHECK(pattern_check(buf, big, 4096, 4) < 0);
+	return 0;
+}
+
+// Write size bytes of the pattern for seed at off into path, or more
+// than one buffer's worth in pieces
+static int test_write(const char* path, size_t size, off_t off, int seed) {
+	static char buf[WRITE_BUFFER_SIZE];
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	int res = cs1550_open(path, &fi);
+	size_t done = 0;
+	while(res >= 0 && done < size) {
+		size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+		pattern_fill(buf, n, off + done, seed);
+		res = cs1550_write(path, buf, n, off + done, &fi);
+		done += res > 0 ? res : 0;
+	}
+	if(fi.fh != 0) {
+		int fres = cs1550_flush(path, &fi);
+		cs1550_release(path, &fi);
+		res = res < 0 ? res : fres;
+	}
+	return res < 0 ? res : 0;
+}
+
+// Images are formatted with extents, so switch this one to chains
+static int test_chains() {
+	cs1550_superblock* super = disk_block(0);
+	super->nFeatures &= ~CS1550_FEATURE_EXTENTS;
+	CHECK(test_remount() == 0);
+	CHECK(!cache.extents);
+	return 0;
+}
+
+// How many blocks are free once everything on its way back is back
+static long test_free_blocks() {
+	reclaim_wait();
+	pthread_mutex_lock(&allocator.lock);
+	long n = allocator.nFree;
+	pthread_mutex_unlock(&allocator.lock);
+	return n;
+}
+
+// A file that's unlinked while it's open loses its name right away, but
+// its handles can still read and write it, and its slot and blocks only
+// come back once the last of them is released. One that was never
+// released, as after a crash, is freed at the next mount.
+static int unlink_open(int extents) {
+	static char buf[64 * 1024];
+	size_t size = sizeof(buf);
+	struct stat st;
+
+	CHECK(extents || test_chains() == 0);
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	long empty = test_free_blocks();
+	CHECK(cs1550_mknod("/d/a.txt", S_IFREG | 0644, 0) == 0);
+	CHECK(test_write("/d/a.txt", size, 0, 1) == 0);
+	long held = empty - test_free_blocks();
+
+	struct fuse_file_info fi, fi2;
+	memset(&fi, 0, sizeof(fi));
+	memset(&fi2, 0, sizeof(fi2));
+	CHECK(cs1550_open("/d/a.txt", &fi) == 0);
+	CHECK(cs1550_open("/d/a.txt", &fi2) == 0);
+
+	// A small write still in the buffer when the name goes
+	pattern_fill(buf, 4096, 0, 2);
+	CHECK(cs1550_write("/d/a.txt", buf, 4096, 0, &fi) == 4096);
+	CHECK(cs1550_unlink("/d/a.txt") == 0);
+	CHECK(cs1550_getattr("/d/a.txt", &st) == -ENOENT);
+	CHECK(cs1550_open("/d/a.txt", &fi) == -ENOENT);
+	CHECK(cs1550_unlink("/d/a.txt") == -ENOENT);
+
+	// Another file gets a slot of its own and none of the blocks
+	CHECK(cs1550_mknod("/d/b.txt", S_IFREG | 0644, 0) == 0);
+	CHECK(test_write("/d/b.txt", size, 0, 3) == 0);
+
+	// Both handles see the buffered write, and can write past the end
+	CHECK(cs1550_read(NULL, buf, size, 0, &fi2) == (int) size);
+	CHECK(pattern_check(buf, 4096, 0, 2) < 0);
+	CHECK(pattern_check(buf + 4096, size - 4096, 4096, 1) < 0);
+	pattern_fill(buf, size, size, 4);
+	CHECK(cs1550_write(NULL, buf, size, size, &fi2) == (int) size);
+	CHECK(cs1550_flush(NULL, &fi2) == 0);
+	CHECK(cs1550_read(NULL, buf, size, size, &fi) == (int) size);
+	CHECK(pattern_check(buf, size, size, 4) < 0);
+	long used = test_free_blocks();
+
+	// The first release gives nothing back, the last one all of it
+	CHECK(cs1550_release(NULL, &fi2) == 0);
+	CHECK(test_free_blocks() == used);
+	CHECK(cs1550_flush(NULL, &fi) == 0);
+	CHECK(cs1550_release(NULL, &fi) == 0);
+	CHECK(test_free_blocks() > used + held);
+
+	// Its slot is the next one used
+	long slots = get_directory(find_directory("d"))->high;
+	CHECK(cs1550_mknod("/d/c.txt", S_IFREG | 0644, 0) == 0);
+	CHECK(get_directory(find_directory("d"))->high == slots);
+	CHECK(test_write("/d/c.txt", size, 0, 5) == 0);
+
+	// A crash after the unlink leaves the slot without a name
+	used = test_free_blocks();
+	struct cs1550_file_directory* c = dir_file(get_directory(find_directory("d")), find_file(find_directory("d"), "c", "txt"));
+	CHECK(c != NULL);
+	memset(c->fname, 0, sizeof(c->fname));
+	memset(c->fext, 0, sizeof(c->fext));
+	cache_mark_dirty(dir_block(get_directory(find_directory("d")), find_file(find_directory("d"), "c", "txt")));
+	CHECK(test_remount() == 0);
+	CHECK(test_free_blocks() >= used + held);
+	CHECK(cs1550_getattr("/d/c.txt", &st) == -ENOENT);
+	CHECK(cs1550_unlink("/d/b.txt") == 0);
+	CHECK(cs1550_rmdir("/d") == 0);
+	CHECK(test_free_blocks() == empty + 1);
+	return 0;
+}
+
+static int test_unlink_open_extents() {
+	return unlink_open(1);
+}
+
+static int test_unlink_open_chains() {
+	return unlink_open(0);
+}
+
+// Write the first blocks blocks of two files a block at a time, taking
+// turns, so neither can grow in place and each block of each file is a
+// run of its own
+static int test_fragment(const char* a, const char* b, long blocks) {
+	long i = 0;
+	for(i = 0; i < blocks; i++) {
+		CHECK(test_write(a, BLOCK_SIZE, i * BLOCK_SIZE, 1) == 0);
+		CHECK(test_write(b, BLOCK_SIZE, i * BLOCK_SIZE, 2) == 0);
+	}
+	return 0;
+}
+
+// How many extent blocks and extents path has, or -1
+static int test_extents(const char* path, long* nBlocks, long* nExtents) {
+	char dir[MAX_FILENAME + 1], name[MAX_FILENAME + 1], ext[MAX_EXTENSION + 1];
+	CHECK(parse_path(path, dir, name, ext) == 2);
+	int d = find_directory(dir);
+	CHECK(d >= 0);
+	struct cs1550_file_directory* file = dir_file(get_directory(d), find_file(d, name, ext));
+	CHECK(file != NULL);
+	*nBlocks = 0;
+	*nExtents = 0;
+	long map = file->nStartBlock;
+	while(map != EOF) {
+		cs1550_extent_block* eb = disk_block(map);
+		CHECK(eb != NULL && eb->nExtents > 0 && eb->nExtents <= (int) MAX_EXTENTS_IN_BLOCK);
+		(*nBlocks)++;
+		*nExtents += eb->nExtents;
+		map = table_get(map);
+	}
+	return 0;
+}
+
+// A file in too many pieces for one extent block reads back right from
+// anywhere, through one handle or a fresh one each time, after it's
+// been remounted. A file that only ever grows at its end stays in one
+// extent however it's written.
+static int test_extent_blocks() {
+	static char buf[64 * 1024];
+	const char* path = "/d/a.bin";
+	long blocks = 3 * MAX_EXTENTS_IN_BLOCK + 5;
+	long nBlocks = 0, nExtents = 0;
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	CHECK(cs1550_mknod(path, S_IFREG | 0644, 0) == 0);
+	CHECK(cs1550_mknod("/d/b.bin", S_IFREG | 0644, 0) == 0);
+	CHECK(test_fragment(path, "/d/b.bin", blocks) == 0);
+	CHECK(test_extents(path, &nBlocks, &nExtents) == 0);
+	CHECK(nExtents == blocks && nBlocks == 4);
+	CHECK(test_remount() == 0);
+	CHECK(test_extents(path, &nBlocks, &nExtents) == 0);
+	CHECK(nExtents == blocks && nBlocks == 4);
+
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	CHECK(cs1550_open(path, &fi) == 0);
+	long long size = blocks * BLOCK_SIZE;
+	unsigned int seed = 1;
+	int i = 0;
+	for(i = 0; i < 500; i++) {
+		long long off = rand_r(&seed) % size;
+		long long len = 1 + rand_r(&seed) % (8 * BLOCK_SIZE);
+		long long want = off + len > size ? size - off : len;
+		memset(buf, 0, want);
+		if(i % 2) {
+			CHECK(cs1550_read(path, buf, len, off, &fi) == (int) want);
+		} else {
+			CHECK(test_read(path, buf, len, off) == (int) want);
+		}
+		CHECK(pattern_check(buf, want, off, 1) < 0);
+	}
+	CHECK(cs1550_release(path, &fi) == 0);
+	CHECK(test_read("/d/b.bin", buf, size, 0) == (int) size);
+	CHECK(pattern_check(buf, size, 0, 2) < 0);
+
+	// Written in one go, in pieces across opens, and after a remount
+	const char* seq = "/d/c.bin";
+	CHECK(cs1550_mknod(seq, S_IFREG | 0644, 0) == 0);
+	CHECK(test_write(seq, 3 * WRITE_BUFFER_SIZE, 0, 3) == 0);
+	for(i = 0; i < 20; i++) {
+		CHECK(test_write(seq, 3 * BLOCK_SIZE + 11, 3 * WRITE_BUFFER_SIZE + i * (3 * BLOCK_SIZE + 11), 3) == 0);
+	}
+	CHECK(test_extents(seq, &nBlocks, &nExtents) == 0);
+	CHECK(nExtents == 1 && nBlocks == 1);
+	CHECK(test_remount() == 0);
+	size = 3 * WRITE_BUFFER_SIZE + 20 * (3 * BLOCK_SIZE + 11);
+	CHECK(test_write(seq, 2 * WRITE_BUFFER_SIZE, size, 3) == 0);
+	CHECK(test_extents(seq, &nBlocks, &nExtents) == 0);
+	CHECK(nExtents == 1 && nBlocks == 1);
+	size += 2 * WRITE_BUFFER_SIZE;
+	long long off = 0;
+	for(off = 0; off < size; off += sizeof(buf)) {
+		long long want = size - off < (long long) sizeof(buf) ? size - off : (long long) sizeof(buf);
+		CHECK(test_read(seq, buf, sizeof(buf), off) == (int) want);
+		CHECK(pattern_check(buf, want, off, 3) < 0);
+	}
+	return 0;
+}
+
+// Check that every byte of path from off for size bytes is zero
+static int test_zero(const char* path, size_t size, off_t off) {
+	static char buf[64 * 1024];
+	size_t done = 0;
+	while(done < size) {
+		size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+		CHECK(test_read(path, buf, n, off + done) == (int) n);
+		size_t i = 0;
+		for(i = 0; i < n; i++) {
+			CHECK(buf[i] == 0);
+		}
+		done += n;
+	}
+	return 0;
+}
+
+// Truncating a fragmented file cuts its runs and extent blocks back,
+// gives the blocks past the new end back only once, and leaves handles
+// that were already open reading the right blocks. Growing fills the
+// file out with zeroes, and anything still buffered past the new end
+// is gone.
+static int truncate_file(int extents) {
+	static char buf[64 * 1024];
+	const char* path = "/d/a.bin";
+	long blocks = 100;
+	long keep = 30;
+	struct stat st;
+
+	CHECK(extents || test_chains() == 0);
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	CHECK(cs1550_mknod(path, S_IFREG | 0644, 0) == 0);
+	CHECK(cs1550_mknod("/d/b.bin", S_IFREG | 0644, 0) == 0);
+	CHECK(test_fragment(path, "/d/b.bin", blocks) == 0);
+
+	// A handle that has walked the whole file
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	CHECK(cs1550_open(path, &fi) == 0);
+	CHECK(cs1550_read(path, buf, blocks * BLOCK_SIZE, 0, &fi) == (int) (blocks * BLOCK_SIZE));
+	CHECK(pattern_check(buf, blocks * BLOCK_SIZE, 0, 1) < 0);
+
+	// Cut it partway into a block
+	long before = test_free_blocks();
+	off_t size = keep * BLOCK_SIZE + 100;
+	CHECK(cs1550_truncate(path, size) == 0);
+	CHECK(cs1550_getattr(path, &st) == 0 && st.st_size == size);
+	CHECK(test_free_blocks() >= before + blocks - keep - 1);
+	long after = test_free_blocks();
+	CHECK(cs1550_truncate(path, size) == 0);
+	CHECK(test_free_blocks() == after);
+	CHECK(test_read(path, buf, sizeof(buf), 0) == (int) size);
+	CHECK(pattern_check(buf, size, 0, 1) < 0);
+
+	// Grow it back out. The handle last read the old last block, which
+	// is somewhere else now.
+	off_t grown = blocks * BLOCK_SIZE;
+	CHECK(cs1550_truncate(path, grown) == 0);
+	CHECK(test_zero(path, grown - size, size) == 0);
+	CHECK(cs1550_read(path, buf, BLOCK_SIZE, grown - BLOCK_SIZE, &fi) == BLOCK_SIZE);
+	CHECK(buf[0] == 0 && buf[BLOCK_SIZE - 1] == 0);
+	CHECK(cs1550_read(path, buf, grown, 0, &fi) == (int) grown);
+	CHECK(pattern_check(buf, size, 0, 1) < 0);
+
+	// Write at the new end through the handle
+	pattern_fill(buf, BLOCK_SIZE, grown, 3);
+	CHECK(cs1550_write(path, buf, BLOCK_SIZE, grown, &fi) == BLOCK_SIZE);
+	CHECK(cs1550_flush(path, &fi) == 0);
+	CHECK(cs1550_read(path, buf, BLOCK_SIZE, grown, &fi) == BLOCK_SIZE);
+	CHECK(pattern_check(buf, BLOCK_SIZE, grown, 3) < 0);
+
+	// Bytes still in the write buffer past the new end
+	pattern_fill(buf, 200, 0, 4);
+	CHECK(cs1550_write(path, buf, 200, 0, &fi) == 200);
+	CHECK(cs1550_truncate(path, 50) == 0);
+	CHECK(cs1550_read(path, buf, sizeof(buf), 0, &fi) == 50);
+	CHECK(pattern_check(buf, 50, 0, 4) < 0);
+	CHECK(cs1550_truncate(path, 0) == 0);
+	CHECK(cs1550_read(path, buf, sizeof(buf), 0, &fi) == 0);
+	CHECK(test_write(path, 3 * BLOCK_SIZE + 7, 0, 5) == 0);
+	CHECK(cs1550_release(path, &fi) == 0);
+
+	CHECK(cs1550_truncate("/d", 0) == -EISDIR);
+	CHECK(cs1550_truncate("/d/c.bin", 0) == -ENOENT);
+	CHECK(cs1550_truncate(STATS_PATH, 0) == -EACCES);
+
+	// All of it made it to the image, and the other file is untouched
+	CHECK(test_remount() == 0);
+	CHECK(cs1550_getattr(path, &st) == 0 && st.st_size == 3 * BLOCK_SIZE + 7);
+	CHECK(test_read(path, buf, sizeof(buf), 0) == 3 * BLOCK_SIZE + 7);
+	CHECK(pattern_check(buf, 3 * BLOCK_SIZE + 7, 0, 5) < 0);
+	CHECK(test_read("/d/b.bin", buf, blocks * BLOCK_SIZE, 0) == (int) (blocks * BLOCK_SIZE));
+	CHECK(pattern_check(buf, blocks * BLOCK_SIZE, 0, 2) < 0);
+	return 0;
+}
+
+static int test_truncate_extents() {
+	return truncate_file(1);
+}
+
+static int test_truncate_chains() {
+	return truncate_file(0);
+}
+
+// The allocator hands out every free block exactly once and then
+// reports the disk full. Blocks freed far apart, in different words of
+// the summary, are all found again: first the ones after where the
+// last allocation was, then the ones before it once the search wraps.
+static int test_alloc() {
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	CHECK(cs1550_mknod("/d/a.bin", S_IFREG | 0644, 0) == 0);
+	long nFree = test_free_blocks();
+	long* blocks = malloc(nFree * sizeof(long));
+	CHECK(blocks != NULL);
+
+	// Fill the disk, a block at a time
+	long n = 0, k = 0;
+	while(n <= nFree && (k = alloc_block()) >= 0) {
+		if(n < nFree) {
+			blocks[n] = k;
+		}
+		n++;
+	}
+	int full = n == nFree && test_free_blocks() == 0 && alloc_block() < 0 &&
+			test_write("/d/a.bin", 4 * BLOCK_SIZE, 0, 1) == -ENOSPC;
+	long i = 0;
+	for(i = 1; full && i < n; i++) {
+		full = blocks[i] > blocks[i - 1] && table_get(blocks[i]) == EOF;
+	}
+
+	// Free one block in every summary word, a little further into
+	// each than the last
+	long stride = BITS_PER_WORD * BITS_PER_WORD;
+	long nScattered = 0;
+	for(i = 0; full && blocks[0] + i * stride + i * 37 <= blocks[n - 1]; i++) {
+		free_block(blocks[0] + i * stride + i * 37);
+		nScattered++;
+	}
+	int found = full && nScattered > 2 && test_free_blocks() == nScattered;
+
+	// The search wraps around to the start of the disk for the first,
+	// then keeps going forward from there
+	for(i = 0; found && i < nScattered / 2; i++) {
+		found = alloc_block() == blocks[0] + i * stride + i * 37;
+	}
+
+	// One freed behind the cursor is only found once the search wraps
+	long behind = blocks[0] + 5;
+	if(found) {
+		free_block(behind);
+		found = alloc_block_near(behind) == behind;
+		free_block(behind);
+	}
+	for(i = nScattered / 2; found && i < nScattered; i++) {
+		found = alloc_block() == blocks[0] + i * stride + i * 37;
+	}
+	found = found && alloc_block() == behind && alloc_block() < 0;
+
+	// Give everything back
+	for(i = 0; i < n; i++) {
+		free_block(blocks[i]);
+	}
+	free(blocks);
+	CHECK(full);
+	CHECK(found);
+	CHECK(test_free_blocks() == nFree);
+	CHECK(test_write("/d/a.bin", 4 * BLOCK_SIZE, 0, 1) == 0);
+	return 0;
+}
+
+// A name can have one dot at most, since a second one would put a dot
+// in the extension: such a path can't be made and doesn't exist
+static int test_bad_names() {
+	char dir[MAX_FILENAME + 1], name[MAX_FILENAME + 1], ext[MAX_EXTENSION + 1];
+	struct stat st;
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	CHECK(parse_path("/d/a.b.c", dir, name, ext) == -EINVAL);
+	CHECK(parse_path("/d/a.", dir, name, ext) == 2);
+	CHECK(parse_path("/d/a.b", dir, name, ext) == 2);
+	CHECK(strcmp(name, "a") == 0 && strcmp(ext, "b") == 0);
+
+	CHECK(cs1550_mknod("/d/a.b.c", S_IFREG | 0644, 0) == -EINVAL);
+	CHECK(cs1550_mknod("/d/a..", S_IFREG | 0644, 0) == -EINVAL);
+	CHECK(cs1550_getattr("/d/a.b.c", &st) == -ENOENT);
+	CHECK(cs1550_mknod("/d/a.b", S_IFREG | 0644, 0) == 0);
+	CHECK(cs1550_getattr("/d/a.b.c", &st) == -ENOENT);
+	CHECK(cs1550_getattr("/d/a.b", &st) == 0);
+	CHECK(cs1550_unlink("/d/a.b.c") == -ENOENT);
+	return 0;
+}
+
+// The name index doubles its buckets as it fills, and every name in it
+// can still be found and taken out afterwards
+static int test_index_grow() {
+	int dir = 1 << 20;
+	int n = 1000;
+	long entries = name_index.nEntries;
+	long buckets = name_index.nBuckets;
+	char name[16];
+	int i = 0;
+	for(i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		CHECK(index_insert(dir, name, i % 2 ? "txt" : "", i) == 0);
+	}
+	CHECK(name_index.nEntries == entries + n);
+	CHECK(name_index.nBuckets >= 1024 && name_index.nBuckets > buckets);
+	CHECK(name_index.nEntries <= name_index.nBuckets);
+
+	// Every name leads to its own slot, and nothing else matches
+	for(i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		struct cs1550_index_entry* e = index_find(dir, name, i % 2 ? "txt" : "");
+		CHECK(e != NULL && e->slot == i);
+		CHECK(index_find(dir, name, i % 2 ? "" : "txt") == NULL);
+		CHECK(index_find(dir + 1, name, i % 2 ? "txt" : "") == NULL);
+	}
+
+	// Take every other one out, then the rest
+	for(i = 0; i < n; i += 2) {
+		snprintf(name, sizeof(name), "f%d", i);
+		index_remove(dir, name, "");
+	}
+	for(i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		struct cs1550_index_entry* e = index_find(dir, name, i % 2 ? "txt" : "");
+		CHECK(i % 2 ? e != NULL && e->slot == i : e == NULL);
+	}
+	for(i = 1; i < n; i += 2) {
+		snprintf(name, sizeof(name), "f%d", i);
+		index_remove(dir, name, "txt");
+		CHECK(index_find(dir, name, "txt") == NULL);
+	}
+	CHECK(name_index.nEntries == entries);
+
+	// And it still answers for the names the filesystem puts in it
+	CHECK(find_directory("d") < 0);
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	CHECK(find_directory("d") >= 0);
+	return 0;
+}
+
+// What a listing filled in, in the order it came
+#define LISTING_MAX 256
+
+struct test_listing {
+	char names[LISTING_MAX][MAX_FILENAME + MAX_EXTENSION + 2];
+	struct stat st[LISTING_MAX];
+	off_t off[LISTING_MAX];
+	int n;
+	int limit;	//say the buffer is full once there are this many, if not 0
+};
+
+static int test_filler(void* buf, const char* name, const struct stat* st, off_t off) {
+	struct test_listing* l = buf;
+	if(l->n >= LISTING_MAX || (l->limit > 0 && l->n >= l->limit)) {
+		return 1;
+	}
+	strcpy(l->names[l->n], name);
+	l->st[l->n] = *st;
+	l->off[l->n] = off;
+	l->n++;
+	return 0;
+}
+
+// Where name is in a listing, or -1
+static int test_listed(struct test_listing* l, const char* name) {
+	int i = 0;
+	for(i = 0; i < l->n; i++) {
+		if(strcmp(l->names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// The name of file i of a test directory, and how big it is
+static void dir_test_name(char* name, size_t size, int i) {
+	snprintf(name, size, "/d/f%d.txt", i);
+}
+
+static size_t dir_test_size(int i) {
+	return i * 7 + 1;
+}
+
+// A directory that fills its block chains a new one on, which marks
+// an image that didn't chain directories yet, and the root does the
+// same. Slots that are given up are used again before the directory
+// grows any further, and all of it is still there after a remount.
+static int test_dir_grow() {
+	cs1550_superblock* super = disk_block(0);
+	super->nFeatures &= ~CS1550_FEATURE_DIR_CHAINS;
+	cache_mark_dirty(0);
+	CHECK(test_remount() == 0);
+	super = disk_block(0);
+	CHECK(!(super->nFeatures & CS1550_FEATURE_DIR_CHAINS));
+
+	// Fill the first block, then go past it
+	char name[32];
+	int n = 3 * MAX_FILES_IN_DIR + 2;
+	int i = 0;
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	for(i = 0; i < n; i++) {
+		if(i == MAX_FILES_IN_DIR) {
+			CHECK(!(super->nFeatures & CS1550_FEATURE_DIR_CHAINS));
+		}
+		dir_test_name(name, sizeof(name), i);
+		CHECK(cs1550_mknod(name, S_IFREG | 0644, 0) == 0);
+		CHECK(test_write(name, dir_test_size(i), 0, i) == 0);
+	}
+	CHECK(super->nFeatures & CS1550_FEATURE_DIR_CHAINS);
+	int d = find_directory("d");
+	CHECK(get_directory(d)->nBlocks == 4);
+	CHECK(get_directory(d)->high == n);
+
+	// And the root
+	for(i = 0; i < MAX_DIRS_IN_ROOT; i++) {
+		snprintf(name, sizeof(name), "/r%d", i);
+		CHECK(cs1550_mkdir(name, 0755) == 0);
+	}
+	CHECK(cache.root_slots.nBlocks == 2);
+
+	// The last slot given up is the first one taken again
+	int a = find_file(d, "f5", "txt");
+	int b = find_file(d, "f20", "txt");
+	CHECK(cs1550_unlink("/d/f5.txt") == 0);
+	CHECK(cs1550_unlink("/d/f20.txt") == 0);
+	CHECK(get_directory(d)->nFree == 2);
+	CHECK(cs1550_mknod("/d/g.txt", S_IFREG | 0644, 0) == 0);
+	CHECK(find_file(d, "g", "txt") == b);
+	CHECK(cs1550_mknod("/d/h", S_IFREG | 0644, 0) == 0);
+	CHECK(find_file(d, "h", "") == a);
+	CHECK(get_directory(d)->nFree == 0);
+	CHECK(get_directory(d)->high == n && get_directory(d)->nBlocks == 4);
+	CHECK(cs1550_unlink("/d/h") == 0);
+
+	// Everything is found the same way after a remount
+	CHECK(test_remount() == 0);
+	super = disk_block(0);
+	CHECK(super->nFeatures & CS1550_FEATURE_DIR_CHAINS);
+	d = find_directory("d");
+	CHECK(get_directory(d)->nBlocks == 4 && get_directory(d)->high == n);
+	CHECK(get_directory(d)->nFree == 1);
+	static struct test_listing l;
+	memset(&l, 0, sizeof(l));
+	CHECK(cs1550_readdir("/d", &l, test_filler, 0, NULL) == 0);
+	CHECK(l.n == 2 + n - 1);
+	CHECK(test_listed(&l, "g.txt") >= 0 && test_listed(&l, "f5.txt") < 0 && test_listed(&l, "h") < 0);
+	struct stat st;
+	for(i = 0; i < n; i++) {
+		dir_test_name(name, sizeof(name), i);
+		int found = test_listed(&l, name + 3);
+		if(i == 5 || i == 20) {
+			CHECK(found < 0);
+			CHECK(cs1550_getattr(name, &st) == -ENOENT);
+			continue;
+		}
+		CHECK(found >= 0 && l.st[found].st_size == (off_t) dir_test_size(i));
+		CHECK(cs1550_getattr(name, &st) == 0 && st.st_size == (off_t) dir_test_size(i));
+		char buf[1024];
+		CHECK(test_read(name, buf, sizeof(buf), 0) == (int) dir_test_size(i));
+		CHECK(pattern_check(buf, dir_test_size(i), 0, i) < 0);
+	}
+	memset(&l, 0, sizeof(l));
+	CHECK(cs1550_readdir("/", &l, test_filler, 0, NULL) == 0);
+	CHECK(l.n == 2 + 1 + MAX_DIRS_IN_ROOT);
+	for(i = 0; i < MAX_DIRS_IN_ROOT; i++) {
+		snprintf(name, sizeof(name), "/r%d", i);
+		CHECK(test_listed(&l, name + 1) >= 0);
+		CHECK(cs1550_getattr(name, &st) == 0 && S_ISDIR(st.st_mode));
+	}
+	return 0;
+}
+
+// List path a few entries at a time, each time carrying on from the
+// offset of the last entry the one before took
+static int test_list_paged(const char* path, struct test_listing* l, int page) {
+	memset(l, 0, sizeof(*l));
+	off_t off = 0;
+	while(1) {
+		int n = l->n;
+		l->limit = n + page;
+		CHECK(cs1550_readdir(path, l, test_filler, off, NULL) == 0);
+		CHECK(l->n <= n + page);
+		if(l->n == n) {
+			return 0;
+		}
+		CHECK(l->off[l->n - 1] > off);
+		off = l->off[l->n - 1];
+	}
+}
+
+// A listing that stops whenever the filler is full and picks up again
+// from the last offset it got has every name in it exactly once, with
+// the same attributes getattr gives, however small the pages are and
+// whatever gaps unlinks left
+static int test_readdir_pages() {
+	char name[32];
+	int n = 2 * MAX_FILES_IN_DIR + 3;
+	int i = 0;
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	for(i = 0; i < n; i++) {
+		dir_test_name(name, sizeof(name), i);
+		CHECK(cs1550_mknod(name, S_IFREG | 0644, 0) == 0);
+		CHECK(test_write(name, dir_test_size(i), 0, i) == 0);
+	}
+	for(i = 0; i < n; i += 4) {
+		dir_test_name(name, sizeof(name), i);
+		CHECK(cs1550_unlink(name) == 0);
+	}
+	CHECK(cs1550_mkdir("/e", 0755) == 0);
+
+	static struct test_listing l;
+	int page = 0;
+	for(page = 1; page <= 8; page++) {
+		CHECK(test_list_paged("/d", &l, page) == 0);
+		CHECK(l.n == 2 + n - (n + 3) / 4);
+		CHECK(strcmp(l.names[0], ".") == 0 && S_ISDIR(l.st[0].st_mode));
+		CHECK(strcmp(l.names[1], "..") == 0 && S_ISDIR(l.st[1].st_mode));
+		for(i = 0; i < n; i++) {
+			dir_test_name(name, sizeof(name), i);
+			int at = test_listed(&l, name + 3);
+			if(i % 4 == 0) {
+				CHECK(at < 0);
+				continue;
+			}
+			struct stat st;
+			CHECK(at >= 0 && cs1550_getattr(name, &st) == 0);
+			CHECK(l.st[at].st_mode == st.st_mode && S_ISREG(st.st_mode));
+			CHECK(l.st[at].st_size == st.st_size && st.st_size == (off_t) dir_test_size(i));
+
+			// And only once
+			strcpy(l.names[at], "");
+			CHECK(test_listed(&l, name + 3) < 0);
+		}
+	}
+
+	// The root pages the same way
+	CHECK(test_list_paged("/", &l, 1) == 0);
+	CHECK(l.n == 4);
+	CHECK(test_listed(&l, "d") == 2 && test_listed(&l, "e") == 3);
+	CHECK(S_ISDIR(l.st[2].st_mode) && S_ISDIR(l.st[3].st_mode));
+
+	// Files that go between pages are left out if they hadn't been
+	// listed yet, and nothing that was already listed comes again
+	memset(&l, 0, sizeof(l));
+	l.limit = 5;
+	CHECK(cs1550_readdir("/d", &l, test_filler, 0, NULL) == 0);
+	CHECK(l.n == 5);
+	CHECK(cs1550_unlink("/d/f1.txt") == 0);
+	CHECK(cs1550_unlink("/d/f9.txt") == 0);
+	CHECK(cs1550_mknod("/d/g.txt", S_IFREG | 0644, 0) == 0);
+	l.limit = 0;
+	CHECK(cs1550_readdir("/d", &l, test_filler, l.off[4], NULL) == 0);
+	CHECK(test_listed(&l, "f9.txt") < 0);
+	CHECK(test_listed(&l, "f1.txt") >= 0 && test_listed(&l, "f1.txt") < 5);
+	CHECK(test_listed(&l, "g.txt") >= 5);
+	CHECK(l.n == 2 + n - (n + 3) / 4);
+	for(i = 0; i < l.n; i++) {
+		int j = 0;
+		for(j = i + 1; j < l.n; j++) {
+			CHECK(strcmp(l.names[i], l.names[j]) != 0);
+		}
+	}
+	return 0;
+}
+
+// Wait for the readahead thread to get through everything queued so
+// far. Stopping it once the queue is empty also waits out the request
+// it's still working on.
+static void test_readahead_wait() {
+	while(1) {
+		pthread_mutex_lock(&readahead.lock);
+		int n = readahead.nQueued;
+		pthread_mutex_unlock(&readahead.lock);
+		if(n == 0) {
+			break;
+		}
+		usleep(1000);
+	}
+	readahead_stop();
+	readahead_start();
+}
+
+// Reading a file in order through one handle finds everything after the
+// first read already in the block cache, with the window doubling from
+// READAHEAD_MIN up to READAHEAD_MAX. A read somewhere else starts the
+// window over. Requests that don't fit in the queue are dropped, and so
+// are ones for a file that changed after they were queued.
+static int test_readahead() {
+	static char buf[4096];
+	long blocks = 4096;
+	CHECK(READAHEAD_MIN == 8 && READAHEAD_MAX == 512);
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	CHECK(cs1550_mknod("/d/a.bin", S_IFREG | 0644, 0) == 0);
+	CHECK(cs1550_mknod("/d/b.bin", S_IFREG | 0644, 0) == 0);
+	CHECK(test_write("/d/a.bin", blocks * BLOCK_SIZE, 0, 1) == 0);
+	CHECK(test_write("/d/b.bin", blocks * BLOCK_SIZE, 0, 2) == 0);
+	CHECK(test_remount() == 0);
+	CHECK(readahead.running);
+
+	struct cs1550_bcache_stats before = bcache_stats;
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	CHECK(cs1550_open("/d/a.bin", &fi) == 0);
+	struct cs1550_handle* h = get_handle(&fi);
+	long window = READAHEAD_MIN;
+	long long off = 0;
+	for(off = 0; off < blocks * BLOCK_SIZE; off += sizeof(buf)) {
+		CHECK(cs1550_read("/d/a.bin", buf, sizeof(buf), off, &fi) == sizeof(buf));
+		CHECK(pattern_check(buf, sizeof(buf), off, 1) < 0);
+		test_readahead_wait();
+
+		// It only grows when it asks for more
+		CHECK(h->ra_window == window || h->ra_window == 2 * window || h->ra_window == READAHEAD_MAX);
+		window = h->ra_window;
+	}
+	CHECK(window == READAHEAD_MAX);
+	long first = sizeof(buf) / BLOCK_SIZE;
+	CHECK(bcache_stats.misses - before.misses == (unsigned long) first);
+	CHECK(bcache_stats.hits - before.hits == (unsigned long) (blocks - first));
+	CHECK(bcache_stats.readahead - before.readahead == (unsigned long) (blocks - first));
+
+	// Going back to the start is a seek like any other
+	CHECK(cs1550_read("/d/a.bin", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+	CHECK(h->ra_window == READAHEAD_MIN && h->ra_next == 0);
+	CHECK(cs1550_read("/d/a.bin", buf, sizeof(buf), sizeof(buf), &fi) == sizeof(buf));
+	CHECK(h->ra_window == 2 * READAHEAD_MIN);
+	CHECK(cs1550_release("/d/a.bin", &fi) == 0);
+	test_readahead_wait();
+
+	// Hold the other file still so the thread can't get anywhere with
+	// it, and ask for more than the queue holds
+	memset(&fi, 0, sizeof(fi));
+	CHECK(cs1550_open("/d/b.bin", &fi) == 0);
+	h = get_handle(&fi);
+	before = bcache_stats;
+	pthread_rwlock_wrlock(handle_lock(h));
+	int i = 0;
+	for(i = 0; i < 2 * READAHEAD_QUEUE; i++) {
+		h->ra_offset = 0;
+		h->ra_window = READAHEAD_MIN;
+		h->ra_next = 0;
+		readahead_note(h, 0, BLOCK_SIZE);
+	}
+	pthread_mutex_lock(&readahead.lock);
+	int queued = readahead.nQueued;
+	pthread_mutex_unlock(&readahead.lock);
+
+	// Then change the file the way truncate does, so none of them are
+	// for the file as it is any more
+	h->of->gen++;
+	pthread_rwlock_unlock(handle_lock(h));
+	CHECK(queued == READAHEAD_QUEUE);
+	test_readahead_wait();
+	CHECK(bcache_stats.readahead == before.readahead);
+
+	// Reading it in order still brings the rest in ahead
+	CHECK(cs1550_read("/d/b.bin", buf, sizeof(buf), 0, &fi) == sizeof(buf));
+	CHECK(cs1550_read("/d/b.bin", buf, sizeof(buf), sizeof(buf), &fi) == sizeof(buf));
+	CHECK(pattern_check(buf, sizeof(buf), sizeof(buf), 2) < 0);
+	test_readahead_wait();
+	CHECK(bcache_stats.readahead > before.readahead);
+	CHECK(cs1550_release("/d/b.bin", &fi) == 0);
+	return 0;
+}
+
+// A sync longer than the ring can take in one go is split into pieces
+// that cover all of it
+static int test_io_split() {
+	struct cs1550_io_batch batch;
+	io_batch_init(&batch);
+	size_t len = (5UL << 30) + 4096;
+	off_t pos = 8192;
+	CHECK(io_batch_add(&batch, IO_SYNC, NULL, len, pos) == 0);
+	CHECK(batch.nIos == 6);
+
+	int i = 0;
+	for(i = 0; i < batch.nIos; i++) {
+		CHECK(batch.ios[i].op == IO_SYNC);
+		CHECK(batch.ios[i].len > 0 && batch.ios[i].len <= UINT32_MAX);
+		CHECK(batch.ios[i].pos == pos);
+		pos += batch.ios[i].len;
+	}
+	CHECK(pos == 8192 + (off_t) len);
+	io_batch_free(&batch);
+	return 0;
+}
+
+// An image with more blocks than an int can number gets a table for
+// as many as it can, and a superblock that claims more is refused
+static int test_large_image() {
+	long block_size = MIN_BLOCK_SIZE;
+	long long size = (MAX_TABLE_ENTRIES + 4096) * block_size;
+	int res = test_image(size);
+	if(res < 0) {
+		fprintf(stderr, "cs1550_test: no room for a sparse image of %lld bytes: %s\n", size, strerror(-res));
+		return -1;
+	}
+
+	// Formatted the way mkfs does it, since mounting it would read
+	// the whole table in
+	res = disk_open(disk_path);
+	if(res == 0) {
+		disk_set_geometry(block_size, 0, 0);
+		res = format_disk(0);
+	}
+	cs1550_superblock* super = disk_block(0);
+	int ok = res == 0 && disk.nBlocks > MAX_TABLE_ENTRIES && super->nBlocks == MAX_TABLE_ENTRIES &&
+			super->nTableBlocks * block_size >= MAX_TABLE_ENTRIES * (long) sizeof(int) &&
+			super->nDataStart < super->nBlocks;
+	if(ok) {
+		ok = cache_load() == 0 && cache.nEntries == MAX_TABLE_ENTRIES;
+		cache_drop();
+	}
+
+	// One that claims a block past what an int holds
+	if(ok) {
+		super->nBlocks = MAX_TABLE_ENTRIES + 1;
+		super->nTableBlocks = (super->nBlocks * sizeof(int) + block_size - 1) / block_size;
+		ok = cache_load() == -EINVAL;
+		cache_drop();
+	}
+	disk_close();
+	unlink(disk_path);
+	CHECK(ok);
+	return 0;
+}
+
+// Writing blocks back is charged to the writes that dirtied them, not
+// to the flush that sends them out, and flushing the stats file
+// doesn't change what it reports
+static int test_io_charge() {
+	const char* path = "/d/f.bin";
+	struct cs1550_io_stats write_before, flush_before, after;
+	CHECK(cs1550_mkdir("/d", 0755) == 0);
+	CHECK(cs1550_mknod(path, S_IFREG | 0644, 0) == 0);
+	CHECK(cs1550_flush("/", NULL) == 0);
+	io_stats_get(OP_WRITE, &write_before);
+	io_stats_get(OP_FLUSH, &flush_before);
+
+	// Small writes that stay buffered until the flush
+	static char buf[4096];
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	CHECK(cs1550_open(path, &fi) == 0);
+	int i = 0;
+	for(i = 0; i < 16; i++) {
+		pattern_fill(buf, sizeof(buf), i * sizeof(buf), 1);
+		CHECK(cs1550_write(path, buf, sizeof(buf), i * sizeof(buf), &fi) == (int) sizeof(buf));
+	}
+	CHECK(cs1550_flush(path, &fi) == 0);
+	cs1550_release(path, &fi);
+
+	io_stats_get(OP_WRITE, &after);
+	CHECK(after.physical_written - write_before.physical_written >= 16 * sizeof(buf));
+	io_stats_get(OP_FLUSH, &after);
+	CHECK(after.physical_written == flush_before.physical_written);
+
+	// Dirty something, then flush the stats file
+	CHECK(cs1550_mknod("/d/g.bin", S_IFREG | 0644, 0) == 0);
+	io_stats_get(-1, &flush_before);
+	CHECK(cs1550_flush(STATS_PATH, NULL) == 0);
+	io_stats_get(-1, &after);
+	CHECK(after.physical_written == flush_before.physical_written);
+	CHECK(after.requests == flush_before.requests);
+	return 0;
+}
+
+// An image in the original layout, upgraded in place, keeps its files
+// and can then have more directories than fit in one root block
+static int test_upgrade() {
+	CHECK(test_image(5LL << 20) == 0);
+
+	// A directory with one file in it, the way the original made them
+	CHECK(disk_open(disk_path) == 0);
+	disk_set_geometry(MIN_BLOCK_SIZE, 0, 0);
+	cs1550_root_directory* root = disk_block(0);
+	cs1550_bitmap* table = disk_block(1);
+	cs1550_directory_entry* dir = disk_block(2);
+	root->nDirectories = 1;
+	strcpy(root->directories[0].dname, "old");
+	root->directories[0].nStartBlock = 2;
+	dir->nFiles = 1;
+	strcpy(dir->files[0].fname, "x");
+	strcpy(dir->files[0].fext, "txt");
+	dir->files[0].fsize = 5;
+	dir->files[0].nStartBlock = 3;
+	memcpy(disk_block(3), "hello", 5);
+	table->table[2] = EOF;
+	table->table[3] = EOF;
+	long dirs = MAX_DIRS_IN_ROOT;
+
+	int res = upgrade_disk();
+	int again = upgrade_disk();
+	disk_close();
+	CHECK(res == 0);
+	CHECK(again == -EEXIST);
+
+	options.block_size = MIN_BLOCK_SIZE;
+	cs1550_init(NULL);
+	CHECK(disk.map != NULL);
+	CHECK(cache.super != NULL && cache.dir_chains && !cache.extents);
+
+	char buf[64];
+	CHECK(test_read("/old/x.txt", buf, sizeof(buf), 0) == 5);
+	CHECK(memcmp(buf, "hello", 5) == 0);
+
+	// More directories than the old root block had room for, and a
+	// file that needs more blocks than the old table reached
+	char path[32];
+	long i = 0;
+	for(i = 0; i < dirs * 3; i++) {
+		snprintf(path, sizeof(path), "/d%ld", i);
+		CHECK(cs1550_mkdir(path, 0755) == 0);
+	}
+	CHECK(cs1550_mknod("/old/big.bin", S_IFREG | 0644, 0) == 0);
+	CHECK(test_write("/old/big.bin", 256 * 1024, 0, 5) == 0);
+	CHECK(test_remount() == 0);
+
+	static char data[256 * 1024];
+	CHECK(test_read("/old/big.bin", data, sizeof(data), 0) == (int) sizeof(data));
+	CHECK(pattern_check(data, sizeof(data), 0, 5) < 0);
+	CHECK(test_read("/old/x.txt", buf, sizeof(buf), 0) == 5);
+	CHECK(memcmp(buf, "hello", 5) == 0);
+	struct stat st;
+	snprintf(path, sizeof(path), "/d%ld", dirs * 3 - 1);
+	CHECK(cs1550_getattr(path, &st) == 0 && S_ISDIR(st.st_mode));
+	test_unmount();
+	return 0;
+}
+
+// Every test, with the image it wants. One with no image size makes
+// its own.
+struct test_case {
+	const char* name;
+	int (*run)();
+	long long image_size;
+	long block_size;
+};
+
+static struct test_case tests[] = {
+	{ "write_overlap", test_write_overlap, 16LL << 20, 4096 },
+	{ "unlink_open_extents", test_unlink_open_extents, 16LL << 20, 4096 },
+	{ "unlink_open_chains", test_unlink_open_chains, 16LL << 20, 4096 },
+	{ "extent_blocks", test_extent_blocks, 16LL << 20, 512 },
+	{ "truncate_extents", test_truncate_extents, 16LL << 20, 512 },
+	{ "truncate_chains", test_truncate_chains, 16LL << 20, 512 },
+	{ "alloc", test_alloc, 16LL << 20, 512 },
+	{ "bad_names", test_bad_names, 16LL << 20, 4096 },
+	{ "index_grow", test_index_grow, 16LL << 20, 4096 },
+	{ "dir_grow", test_dir_grow, 16LL << 20, 512 },
+	{ "readdir_pages", test_readdir_pages, 16LL << 20, 512 },
+	{ "readahead", test_readahead, 16LL << 20, 512 },
+	{ "io_split", test_io_split, 16LL << 20, 4096 },
+	{ "io_charge", test_io_charge, 16LL << 20, 4096 },
+	{ "large_image", test_large_image, 0, 0 },
+	{ "upgrade", test_upgrade, 0, 0 },
+};
+
+#define NTESTS ((int) (sizeof(tests) / sizeof(tests[0])))
+
+// Run one test on an image of its own
+static int test_run(struct test_case* t) {
+	int res = t->image_size > 0 ? test_mount(t->image_size, t->block_size) : 0;
+	if(res < 0) {
+		fprintf(stderr, "cs1550_test: mounting %s: %s\n", disk_path, strerror(-res));
+	} else {
+		res = t->run();
+	}
+	if(t->image_size > 0) {
+		test_unmount();
+	}
+	printf("%s %s\n", res < 0 ? "FAIL" : "ok", t->name);
+	fflush(stdout);
+	return res;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-d dir] [test ...]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+	int c = 0;
+	while((c = getopt(argc, argv, "d:")) != -1) {
+		switch(c) {
+			case 'd': test_dir = optarg; break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+
+	// With no names, everything runs
+	int failed = 0, i = 0;
+	for(i = 0; i < NTESTS; i++) {
+		int wanted = optind == argc;
+		int j = 0;
+		for(j = optind; j < argc; j++) {
+			wanted |= strcmp(argv[j], tests[i].name) == 0;
+		}
+		if(wanted && test_run(&tests[i]) < 0) {
+			failed++;
+		}
+	}
+
+	// The operations are only there for the mount
+	(void) hello_oper;
+	return failed > 0 ? 1 : 0;
+}
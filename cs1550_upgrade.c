@@ -0,0 +1,91 @@
+/*
+	cs1550_upgrade: turn an image in the original layout into one with
+	a superblock
+
+	This is done offline, so the filesystem itself never carries it.
+	It isn't built on its own: mkfs.cs1550 and cs1550_test include it
+	right after cs1550.c, whose layout and helpers it uses.
+*/
+
+// Give an image in the original layout a superblock and a 32-bit
+// table in place, so its directories and root can grow. Its files stay
+// chains of blocks. The original's table only reaches the first
+// MAX_MAP_ENTRIES blocks, so nothing past them is in use, and the new
+// table goes in the first free run that holds it and a copy of the
+// root. The superblock goes over the old root last, so an upgrade cut
+// short leaves the original as it was. Returns -EEXIST if the image
+// already has a superblock, or -EINVAL if it's blank.
+static int upgrade_disk() {
+	cs1550_root_directory* root = disk_block(0);
+	cs1550_bitmap* old = disk_block(1);
+	if(root == NULL || old == NULL || BLOCK_SIZE != MIN_BLOCK_SIZE) {
+		return -EIO;
+	}
+	if(((cs1550_superblock*) root)->magic == CS1550_MAGIC) {
+		return -EEXIST;
+	}
+	if(block_is_zero(0) && block_is_zero(1)) {
+		return -EINVAL;
+	}
+
+	long nEntries = disk.nBlocks < MAX_TABLE_ENTRIES ? disk.nBlocks : MAX_TABLE_ENTRIES;
+	long table_blocks = (nEntries * sizeof(int) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// Find room for the root and the table together
+	long start = START_ALLOC_INDEX;
+	long run = 0;
+	long i = 0;
+	for(i = START_ALLOC_INDEX; i < nEntries && run < table_blocks + 1; i++) {
+		if(i < (long) MAX_MAP_ENTRIES && old->table[i] != 0) {
+			start = i + 1;
+			run = 0;
+		} else {
+			run++;
+		}
+	}
+	if(run < table_blocks + 1) {
+		return -ENOSPC;
+	}
+	long root_block = start;
+	long table_start = start + 1;
+
+	// The new table holds the old one's entries, and the blocks
+	// we take for ourselves are marked as used
+	for(i = 0; i < table_blocks; i++) {
+		if(!block_is_zero(table_start + i)) {
+			memset(disk_block(table_start + i), 0, BLOCK_SIZE);
+		}
+	}
+	int* table = disk_block(table_start);
+	for(i = 0; i < (long) MAX_MAP_ENTRIES && i < nEntries; i++) {
+		table[i] = old->table[i];
+	}
+	table[0] = EOF;
+	for(i = root_block; i < table_start + table_blocks; i++) {
+		table[i] = EOF;
+	}
+	memcpy(disk_block(root_block), root, BLOCK_SIZE);
+	int res = disk_sync();
+	if(res < 0) {
+		return res;
+	}
+
+	// Only now does the image stop being the original
+	cs1550_superblock super;
+	memset(&super, 0, sizeof(super));
+	super.magic = CS1550_MAGIC;
+	super.version = CS1550_VERSION;
+	super.nBlockSize = BLOCK_SIZE;
+	super.nEntrySize = sizeof(int);
+	super.nBlocks = nEntries;
+	super.nRootBlock = root_block;
+	super.nTableStart = table_start;
+	super.nTableBlocks = table_blocks;
+	super.nDataStart = START_ALLOC_INDEX;
+	super.nFeatures = CS1550_FEATURE_DIR_CHAINS;
+	super.nFilesInDir = MAX_FILES_IN_DIR;
+	super.nDirsInRoot = MAX_DIRS_IN_ROOT;
+	memset(root, 0, BLOCK_SIZE);
+	memcpy(root, &super, sizeof(super));
+	return disk_sync();
+}
@@ -0,0 +1,170 @@
+/*
+	mkfs.cs1550: make a preformatted .disk image
+
+	The image is made sparse with ftruncate, and only the superblock,
+	the root and the start of the allocation table are ever written, so
+	even a very large image is formatted at once and takes up next to
+	no room on the host until files are written to it.
+
+	With -u it instead upgrades an image in the original layout, with
+	no superblock, in place: its files are kept, and its directories
+	and root can grow from then on.
+
+	usage: mkfs.cs1550 [-f] [-b block_size] -s size [image]
+	       mkfs.cs1550 -u [image]
+*/
+
+// Everything but main comes from the filesystem itself, so the layout
+// we write is exactly the one it formats a blank image with. The
+// upgrade is only ever done offline, so it's kept out of the mount.
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+#include "cs1550_upgrade.c"
+
+// Parse a size like 4096, 64K, 100M or 10G into bytes, or -1
+static long long parse_size(const char* arg) {
+	char* end = NULL;
+	errno = 0;
+	long long size = strtoll(arg, &end, 10);
+	if(errno != 0 || end == arg || size <= 0) {
+		return -1;
+	}
+
+	// An optional binary suffix
+	long long scale = 1;
+	switch(*end) {
+		case 'k': case 'K': scale = 1LL << 10; end++; break;
+		case 'm': case 'M': scale = 1LL << 20; end++; break;
+		case 'g': case 'G': scale = 1LL << 30; end++; break;
+		case 't': case 'T': scale = 1LL << 40; end++; break;
+	}
+	if(*end != '\0' || size > LLONG_MAX / scale) {
+		return -1;
+	}
+	return size * scale;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-f] [-b block_size] -s size [image]\n", prog);
+	fprintf(stderr, "       %s -u [image]\n", prog);
+	fprintf(stderr, "  -s size        size of the image, with an optional K, M, G or T suffix\n");
+	fprintf(stderr, "  -b block_size  power of two from %d to %d (default %d)\n",
+			MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, MIN_BLOCK_SIZE);
+	fprintf(stderr, "  -f             replace the image if it already exists\n");
+	fprintf(stderr, "  -u             upgrade an image in the original layout, keeping its files\n");
+}
+
+// Upgrade the image at path in place
+static int upgrade(const char* prog, const char* path) {
+	int res = disk_open(path);
+	if(res == 0) {
+		disk_set_geometry(MIN_BLOCK_SIZE, 0, 0);
+		res = upgrade_disk();
+	}
+	if(res == -EEXIST) {
+		fprintf(stderr, "%s: %s already has a superblock\n", prog, path);
+	} else if(res == -EINVAL) {
+		fprintf(stderr, "%s: %s is blank, there is nothing to upgrade\n", prog, path);
+	} else if(res < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(-res));
+	} else {
+		cs1550_superblock* super = disk_block(0);
+		printf("%s: %ld blocks of %ld bytes, root at block %ld, %ld table blocks from block %ld\n",
+				path, super->nBlocks, (long) BLOCK_SIZE, super->nRootBlock,
+				super->nTableBlocks, super->nTableStart);
+	}
+	disk_close();
+	return res < 0 ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+	long long size = -1;
+	long block_size = MIN_BLOCK_SIZE;
+	int force = 0;
+	int upgrading = 0;
+
+	int c = 0;
+	while((c = getopt(argc, argv, "b:fs:u")) != -1) {
+		switch(c) {
+			case 'b':
+				block_size = parse_size(optarg);
+				break;
+			case 'f':
+				force = 1;
+				break;
+			case 's':
+				size = parse_size(optarg);
+				break;
+			case 'u':
+				upgrading = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if((size < 0) != upgrading || optind < argc - 1) {
+		usage(argv[0]);
+		return 2;
+	}
+	const char* path = optind < argc ? argv[optind] : ".disk";
+	if(upgrading) {
+		(void) hello_oper;
+		return upgrade(argv[0], path);
+	}
+
+	if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+			(block_size & (block_size - 1)) != 0) {
+		fprintf(stderr, "%s: bad block size\n", argv[0]);
+		return 2;
+	}
+	// Same minimum the mount asks of a blank image
+	if(size < block_size * 4) {
+		fprintf(stderr, "%s: an image of %ld byte blocks needs at least %ld bytes\n",
+				argv[0], block_size, block_size * 4);
+		return 2;
+	}
+	// and no more blocks than the table can number
+	if(size / block_size > MAX_TABLE_ENTRIES) {
+		fprintf(stderr, "%s: an image of %ld byte blocks can be at most %lld bytes, use bigger blocks\n",
+				argv[0], block_size, (long long) MAX_TABLE_ENTRIES * block_size);
+		return 2;
+	}
+
+	// Make the image, all of it one hole to begin with. Anything that
+	// was there before has to go, since the table is assumed to be zero.
+	int flags = O_RDWR | O_CREAT | (force ? O_TRUNC : O_EXCL);
+	int fd = open(path, flags, 0644);
+	if(fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+		return 1;
+	}
+	if(ftruncate(fd, size) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	// Lay it out through the mapping so only the pages we touch get
+	// written. Reading the holes of the table back costs nothing.
+	int res = disk_open(path);
+	if(res == 0) {
+		disk_set_geometry(block_size, 0, 0);
+		res = format_disk(0);
+	}
+	if(res < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(-res));
+		disk_close();
+		return 1;
+	}
+
+	cs1550_superblock* super = disk_block(0);
+	printf("%s: %ld blocks of %ld bytes, %ld table blocks, data from block %ld\n",
+			path, disk.nBlocks, block_size, super->nTableBlocks, super->nDataStart);
+	disk_close();
+
+	// The operations are only there for the mount
+	(void) hello_oper;
+	return 0;
+}